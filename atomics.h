@@ -20,12 +20,15 @@
 
 #define atomic_exchange(n, v, o) __atomic_exchange_n(&(n), v, o)
 //ewwwwww
-#define _GET_MACRO(_1,_2,_3,_4,NAME,...) NAME
+#define _GET_MACRO(_1,_2,_3,_4,_5,NAME,...) NAME
 
-#define _atomic_cas4(e, n, o, lo)
-#define _atomic_cas3(e, n, o) _atomic_cas4(&(e), (n), o, mem_relaxed)
+//atomic_cas(n, e, v, o[, fo]) - e is an lvalue holding the expected
+//value, and gets the current one on failure. fo defaults to relaxed
+#define _atomic_cas5(n, e, v, o, fo) \
+	__atomic_compare_exchange_n(&(n), &(e), (v), 0, o, fo)
+#define _atomic_cas4(n, e, v, o) _atomic_cas5(n, e, v, o, mem_relaxed)
 
-#define atomic_cas(...) _GET_MACRO(__VA_ARGS__, _atomic_cas4, _atomic_cas3)(__VA_ARGS__)
+#define atomic_cas(...) _GET_MACRO(__VA_ARGS__, _atomic_cas5, _atomic_cas4)(__VA_ARGS__)
 
 #define thread_l __thread
 
@@ -2,27 +2,108 @@
 #include "hash_table.h"
 #include "atomics.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define mcache_size 16
 #define no_free ((struct message_queue *)1)
 
+//defaults for the table policy, see struct table_policy
 #define hash_load 2
+#define def_growth 2
+#define def_start 128
+#define def_target_load 25
+#define def_seg_elems (1 << 18)
+#define desize_rat 10
+#define rehash_rat 5
+
+//bounds the policy is held to, also by the auto-tuner.
+//a bigger growth factor could never be used, see max_grow
+#define max_probes 8
+#define max_growth 8
+
+//slots checked after the probes fail, before resizing
+#define stash_size 8
+
+//a single insert may at most grow its segment by this factor
+//in all, and try this many salts before it gives up on the key
+#define max_grow 8
+#define max_resize_tries 16
+
+//segments at least the policy's seg_elems split in two instead
+//of growing, until the directory is max_dir_depth bits deep
+#define max_dir_depth 16
+
+//segments with fewer slots than this are always rehashed by the
+//writer alone, helper threads cost more than they save. Helpers split
+//up the slots, so those measure the work better than live items,
+//which at two probes run out well under a tenth of the slots
+#define par_rehash_min (1 << 16)
+#define max_rehash_threads 64
+
+//entries in each thread's cache of recent hits, over all tables
+#define hot_cache_bits 8
+
+//records a thread buffers before writing them out as a chunk
+#define trace_buf_recs 4096
+
+//slots the clock hand visits on each insert in cache mode,
+//beyond whatever it takes to get back under the limit
+#define sweep_step 4
+
+//copied keys go in chunks that double from key_chunk_min,
+//up to key_chunk_max or the size of the key
+#define key_chunk_min 4096
+#define key_chunk_max (1 << 20)
+
+//counters and lists each segment keeps for writers in multi-writer
+//mode, and the counts of writers inside the table, so writers on
+//different cores don't fight over one cache line
+#define count_shards 16
+
+//set in access while a writer has the table to itself
+#define write_excl 1
+
+//shared memory regions are carved into blocks with boundary tags.
+//free ones are listed by the power of two their size is in, split
+//to fit an allocation and merged with free neighbours when freed
+#define shm_magic 0x73686d5f68617368ULL
+#define shm_classes 48
+#define shm_block_hdr 16
+//a free block also holds its list links, and its size at the end
+#define shm_min_block 48
+//low bits of a block's size word
+#define blk_used 1
+#define blk_prev_used 2
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
 
 #define is_del 1
+//claimed by a writer in multi-writer mode, and not filled in yet
+#define is_busy 2
 
 #define _inc_size 1
 #define _no_inc 0
 #define _desize -1
 
-#define desize_rat 10
-#define rehash_rat 5
-
 #define _exists ((item *)2)
 
+//retire_block calls retirefn again after sleeping this many
+//nanoseconds, doubling up to retire_wait_max
+#define retire_wait_min 1000
+#define retire_wait_max 1000000
+
 //simple test for 0
 #define test_empty(key) ((key) == 0)
 
@@ -30,7 +111,7 @@
 
 //returns if any bits after the first two exist
 //so returns false for 0, 1, 2
-#define has_elem(key) ((key) > 1)
+#define has_elem(key) ((key) > is_busy)
 
 //elements are only inserted by writer, so that's easy
 //elements are removed by storing removal candidates
@@ -43,7 +124,8 @@ typedef uint16_t hz_ct;
 
 typedef enum message_type {
 	add_item,
-	remove_item
+	remove_item,
+	replace_item
 } message_type;
 
 typedef enum message_mode {
@@ -60,6 +142,7 @@ typedef struct message {
 	struct message_queue *fromwhich;
 	size_t timestamp;
 	message_type mtype;
+	uint64_t keyh; //hashed once by commit_batch
 } message;
 
 typedef struct message_queue {
@@ -86,7 +169,10 @@ static thread_l message_queue *local_queue = 0;
 typedef struct {
 	buffer back;
 	hz_ct nactive;
+	uint64_t lookups; //counted for the auto-tuner, next to the reader's counter
+	uint64_t probes;
 	buffer front;
+	uint64_t blocked_since; //when the writer first saw it hold back a directory
 } hz_st;
 
 typedef struct item {
@@ -97,19 +183,120 @@ typedef struct item {
 	struct item *iter_next; //used for iterating. hence the name
 } item;
 
+//what cache mode keeps for each slot, in an array beside the slots.
+//segments only get one once cache mode is on, so nothing else pays for it
+typedef struct slot_meta {
+	uint32_t expires; //seconds after the epoch. 0 never expires
+	char ref; //set by readers and cleared by the clock hand
+	char evicted;
+} slot_meta;
+
+//a region is mapped at the same address in every process,
+//so pointers into it are valid everywhere and the table
+//needs no special handling to live inside of it
+//a block's header, and while it's free its list links.
+//pad keeps what's handed out 16 byte aligned
+typedef struct shm_block {
+	size_t word; //size, a multiple of shm_block_hdr, and blk_ flags
+	size_t pad;
+	struct shm_block *next;
+	struct shm_block *prev;
+} shm_block;
+
+typedef struct shm_region {
+	uint64_t magic;
+	char *base;
+	size_t size;
+	size_t end; //offset past the last block
+	struct shm_block *free_lists[shm_classes];
+	struct shared_hash_table *sht;
+} shm_region;
+
+//ring of committed writes, for followers to replay.
+//records are written like a seqlock - seq is zeroed while
+//a slot is being rewritten, and readers recheck it afterwards
+typedef struct change_rec {
+	uint64_t seq;
+	const void *key;
+	void *data;
+	message_type mtype;
+} change_rec;
+
+typedef struct change_feed {
+	buffer _back;
+	uint64_t last; //last sequence readers may see
+	buffer _last;
+	uint64_t head; //last sequence written, only the writer reads it
+	size_t capacity;
+	change_rec recs[];
+} change_feed;
+
+//table-owned copies of keys, bump allocated in insertion order.
+//a segment's chunks are freed with it, and a rehash only copies
+//the live keys over, so removed keys are dropped then
+typedef struct key_chunk {
+	struct key_chunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+} key_chunk;
+
+typedef struct count_shard {
+	int64_t live;
+	int64_t dead;
+	item *active_l; //added by shared writers, walked with the segment's own
+	item *cleanup; //removed by shared writers, moved over by fold_counts
+	char _pad[32];
+} count_shard;
+
+//shared writers count themselves in here instead of in access
+typedef struct writer_shard {
+	size_t inside;
+	char _pad[56];
+} writer_shard;
+
+//a segment of the table. everything in it shares its top depth hash bits
 typedef struct hash_table {
 	uint64_t n_elements;
 	uint64_t active_count;
-	uint64_t n_hazards;
+	uint64_t dead_count;
+	uint64_t depth;
 	uint64_t salt;
+	uint64_t probes; //slots tried before the stash, fixed for the segment
+	uint64_t start_live; //live items it was made with
+	uint64_t stash_count;
 	item *elems;
+	item *stash;
 	item *active_l;
 	item *cleanup_with_me;
-	uint16_t *hazard_start;
 	struct hash_table *next;
+	uint64_t hand;
+	slot_meta *meta; //one per slot and stash slot, cache mode only
+	key_chunk *keys;
+	keylenfn_type keylen; //copies keys into keys if set
+	char priv; //copied by a batch, and not visible yet
+	shm_region *region;
+	count_shard counts[count_shards]; //folded into the counts above
 	char actual_data[];
 } hash_table;
 
+//the top depth bits of a hash pick a segment, and a segment that is
+//less deep than the directory fills a run of entries. Segments grow
+//or split on their own and readers pick that up with a new directory,
+//so growing never copies more than a single segment
+typedef struct hash_dir {
+	uint64_t depth;
+	size_t retired; //bytes freed with it, once it's retired
+	hz_ct *hazard_start;
+	struct hash_dir *next;
+	hash_table *dead_segs; //segments no newer directory points to
+	message *pushed; //values a batch pushed out, for delfn once retired
+	char *pushed_keys; //their keys, if the table copies keys
+	delfn_type delfn;
+	void *del_params;
+	hash_table *segs[];
+} hash_dir;
+
 typedef struct shared_hash_table {
 	buffer _back;
 
@@ -124,17 +311,50 @@ typedef struct shared_hash_table {
     size_t timestamp;
 
     buffer hash_data;
-	struct hash_table *current_table;
-	struct hash_table *old_tables;
+	struct hash_dir *current_dir;
+	//bumped when slots stop being what the hot cache saw, and odd
+	//while a directory is being replaced
+	uint64_t generation;
+	char hot_cache;
+	struct hash_dir *old_dirs;
 	size_t nhazards;
 	size_t access;
 	hashfn_type hashfn;
 	compfn_type compfn;
+	shm_region *region;
+	change_feed *feed;
+	char cache_on;
+	size_t cache_max;
+	uint64_t epoch;
+	delfn_type evictfn;
+	void *evict_params;
+	struct rehash_pool *pool; //helpers for big rehashes, or 0
+	char multi_writer;
+	struct table_policy policy;
+	uint64_t tuned_lookups; //reader totals at the last tuning
+	uint64_t tuned_probes;
+	size_t n_active;
+	size_t hand_idx;
+	size_t retired_bytes;
+	size_t retired_max;
+	retirefn_type retirefn;
+	void *retire_params;
+	message *defer_head; //inserts waiting for retired memory to be freed
+	message *defer_tail;
+	struct trace *trace;
+	size_t resizes;
+
+	writer_shard writers[count_shards];
 
 	buffer _hrefs;
 	hz_st hazard_refs[];
 } shared_hash_table;
 
+//seeds the table salts, so where keys land can't be predicted
+//from outside the process
+static uint64_t proc_seed;
+static uint64_t salt_ctr;
+
 //thanks internet
 static inline uint64_t rotl64(uint64_t x, int8_t r)
 {
@@ -152,12 +372,45 @@ static uint64_t avalanche64(uint64_t h, uint64_t salt) {
 	//probably some ultra-bit-expr
 	//that does this and satisfies the pipeline
 	//better. This wil almost certainly not be a
-	//bottleneck though
-	return h < 2 ? 2 : h;
+	//bottleneck though.
+	//0, 1 and 2 mark empty, removed and busy slots
+	return h <= is_busy ? is_busy + 1 : h;
 }
 
 
 
+static uint64_t now_secs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void init_proc_seed() {
+	uint64_t seed = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+			seed = 0;
+		}
+		close(fd);
+	}
+	//no urandom, fall back to whatever varies between runs
+	if (seed == 0) {
+		seed = avalanche64((uint64_t)time(NULL), (uint64_t)getpid());
+		seed = avalanche64(seed, (uint64_t)&seed);
+	}
+	//racing initializers are fine - every table keeps its own salt
+	atomic_store(proc_seed, seed, mem_relaxed);
+}
+
+static uint64_t new_salt() {
+	if (!atomic_load(proc_seed, mem_relaxed)) {
+		init_proc_seed();
+	}
+	uint64_t ctr = atomic_fetch_add(salt_ctr, 1, mem_relaxed);
+	return avalanche64(ctr, atomic_load(proc_seed, mem_relaxed));
+}
+
 static void put_to_queue(message **qhead, message *m) {
 	m->next = 0;
 	message *oldhead = atomic_exchange(*qhead, m, mem_release);
@@ -243,16 +496,135 @@ static void return_message(message *mess) {
 	}
 }
 
-static void *alloc_mem(size_t s) {
+/****
+* shared memory
+*/
+
+//a reader process's view of a table. function pointers differ
+//between processes, so the ones in the table are only the writer's
+typedef struct shm_handle {
+	shared_hash_table *sht;
+	hashfn_type hashfn;
+	compfn_type compfn;
+} shm_handle;
+
+static inline size_t blk_size(const shm_block *b) {
+	return b->word & ~(size_t)(shm_block_hdr - 1);
+}
+
+static inline shm_block *blk_at(shm_block *b, size_t off) {
+	return (shm_block *)((char *)b + off);
+}
+
+//the power of two at or below size
+static size_t blk_class(size_t size) {
+	size_t cls = 0;
+	while (cls + 1 < shm_classes && ((size_t)2 << cls) <= size) {
+		cls++;
+	}
+	return cls;
+}
+
+static void unlink_free(shm_region *r, shm_block *b) {
+	if (b->prev) {
+		b->prev->next = b->next;
+	}
+	else {
+		r->free_lists[blk_class(blk_size(b))] = b->next;
+	}
+	if (b->next) {
+		b->next->prev = b->prev;
+	}
+}
+
+static void push_free(shm_region *r, shm_block *b, size_t size, size_t prev_used) {
+	b->word = size | prev_used;
+	*(size_t *)((char *)blk_at(b, size) - sizeof(size_t)) = size;
+	shm_block **head = &r->free_lists[blk_class(size)];
+	b->prev = 0;
+	b->next = *head;
+	if (*head) {
+		(*head)->prev = b;
+	}
+	*head = b;
+	shm_block *next = blk_at(b, size);
+	if ((char *)next < r->base + r->end) {
+		next->word &= ~(size_t)blk_prev_used;
+	}
+}
+
+//only the writer allocates, under the write lock
+static void *region_alloc(shm_region *r, size_t s) {
+	size_t need = (s + 2 * shm_block_hdr - 1) & ~(size_t)(shm_block_hdr - 1);
+	if (need < s) {
+		return 0;
+	}
+	if (need < shm_min_block) {
+		need = shm_min_block;
+	}
+	//blocks in need's own class may be too small, any above will do
+	size_t cls = blk_class(need);
+	shm_block *b = r->free_lists[cls];
+	while (b && blk_size(b) < need) {
+		b = b->next;
+	}
+	while (!b && ++cls < shm_classes) {
+		b = r->free_lists[cls];
+	}
+	if (!b) {
+		return 0;
+	}
+	unlink_free(r, b);
+	size_t size = blk_size(b);
+	size_t prev_used = b->word & blk_prev_used;
+	if (size - need >= shm_min_block) {
+		push_free(r, blk_at(b, need), size - need, blk_prev_used);
+		size = need;
+	}
+	else if ((char *)blk_at(b, size) < r->base + r->end) {
+		blk_at(b, size)->word |= blk_prev_used;
+	}
+	b->word = size | blk_used | prev_used;
+	return (char *)b + shm_block_hdr;
+}
+
+static void region_free(shm_region *r, void *tof) {
+	shm_block *b = (shm_block *)((char *)tof - shm_block_hdr);
+	size_t size = blk_size(b);
+	size_t prev_used = b->word & blk_prev_used;
+	shm_block *next = blk_at(b, size);
+	if ((char *)next < r->base + r->end && !(next->word & blk_used)) {
+		unlink_free(r, next);
+		size += blk_size(next);
+	}
+	if (!prev_used) {
+		size_t psize = *(size_t *)((char *)b - sizeof(size_t));
+		b = (shm_block *)((char *)b - psize);
+		unlink_free(r, b);
+		size += psize;
+		prev_used = b->word & blk_prev_used;
+	}
+	push_free(r, b, size, prev_used);
+}
+
+static void *alloc_mem(shm_region *r, size_t s) {
+	if (r) {
+		return region_alloc(r, s);
+	}
 	return malloc(s);
 }
 
-static void free_mem(void *tof) {
-	free(tof);
+static void free_mem(shm_region *r, void *tof) {
+	if (r) {
+		region_free(r, tof);
+	}
+	else {
+		free(tof);
+	}
 }
 
-static size_t calc_ht_size(size_t n_elements, size_t n_hazards) {
-	return sizeof(hash_table) + n_elements * sizeof(item) + sizeof(hz_ct) * n_hazards;
+static size_t calc_ht_size(size_t n_elements) {
+	return sizeof(hash_table) + (n_elements + stash_size) * sizeof(item);
 }
 
 static void free_htable(hash_table *ht) {
@@ -263,54 +635,474 @@ static void free_htable(hash_table *ht) {
 		//free_mem((void *)tofree->data);
 		tofree = tofree->next;
 	}
-	free_mem(ht);
+	key_chunk *kc = ht->keys;
+	while (kc) {
+		key_chunk *nxt = kc->next;
+		free_mem(ht->region, kc);
+		kc = nxt;
+	}
+	if (ht->meta) {
+		free_mem(ht->region, ht->meta);
+	}
+	free_mem(ht->region, ht);
+}
+
+//copies len bytes of key to the end of the arena.
+//copies are 8 byte aligned, in case keys are structs
+static const void *arena_copy(key_chunk **arena,
+							  shm_region *r,
+							  const void *key,
+							  size_t len) {
+	size_t need = (len + 7) & ~(size_t)7;
+	key_chunk *kc = *arena;
+	if (!kc || kc->used + need > kc->size) {
+		size_t size = kc ? 2 * kc->size : key_chunk_min;
+		if (size > key_chunk_max) {
+			size = key_chunk_max;
+		}
+		if (size < need) {
+			size = need;
+		}
+		key_chunk *nc = alloc_mem(r, sizeof(key_chunk) + size);
+		if (!nc) {
+			return 0;
+		}
+		nc->next = kc;
+		nc->used = 0;
+		nc->size = size;
+		*arena = kc = nc;
+	}
+	char *at = kc->data + kc->used;
+	memcpy(at, key, len);
+	kc->used += need;
+	return at;
+}
+
+static inline const void *copy_key(hash_table *ht, key_chunk **arena, const void *key) {
+	return arena_copy(arena, ht->region, key, ht->keylen(key));
 }
 
-static hash_table *create_ht(size_t n_el, size_t n_hz) {
-	size_t hsize = calc_ht_size(n_el, n_hz);
-	hash_table *ht = alloc_mem(hsize);
+static hash_table *create_ht(size_t n_el, shm_region *r) {
+	size_t hsize = calc_ht_size(n_el);
+	hash_table *ht = alloc_mem(r, hsize);
+	if (!ht) {
+		return 0;
+	}
 	memset(ht, 0, hsize);
+	ht->region = r;
 	ht->n_elements = n_el;
 	ht->elems = (item *)ht->actual_data;
-	ht->hazard_start = (hz_ct *)(ht->elems + n_el);
-	ht->n_hazards = n_hz;
+	ht->stash = ht->elems + n_el;
 	return ht;
 }
 
-shared_hash_table *create_tbl(hashfn_type hashfn, compfn_type compfn) {
-	size_t nstart = 128;
+//list i of a segment's items: its own, then each shard's
+#define active_lists (count_shards + 1)
+
+static inline item *active_list(const hash_table *ht, size_t i) {
+	return i ? atomic_load(ht->counts[i - 1].active_l, mem_acquire)
+			 : atomic_load(ht->active_l, mem_acquire);
+}
+
+static inline slot_meta *meta_of(const hash_table *ht, const item *it) {
+	//elems and the stash are contiguous
+	return &ht->meta[it - ht->elems];
+}
+
+static char add_meta(hash_table *ht) {
+	size_t msize = (ht->n_elements + stash_size) * sizeof(slot_meta);
+	slot_meta *meta = alloc_mem(ht->region, msize);
+	if (!meta) {
+		return 0;
+	}
+	memset(meta, 0, msize);
+	//readers of a live segment may pick it up at any point
+	atomic_store(ht->meta, meta, mem_release);
+	return 1;
+}
+
+static size_t dir_bytes(const shared_hash_table *sht, const hash_dir *d) {
+	return sizeof(hash_dir)
+		 + ((size_t)1 << d->depth) * sizeof(hash_table *)
+		 + sht->nhazards * sizeof(hz_ct);
+}
+
+static size_t seg_bytes(const hash_table *ht) {
+	size_t total = calc_ht_size(ht->n_elements);
+	if (ht->meta) {
+		total += (ht->n_elements + stash_size) * sizeof(slot_meta);
+	}
+	for (const key_chunk *kc = ht->keys; kc; kc = kc->next) {
+		total += sizeof(key_chunk) + kc->size;
+	}
+	return total;
+}
+
+static hash_dir *create_dir(shared_hash_table *sht, uint64_t depth) {
+	size_t n = (size_t)1 << depth;
+	size_t dsize = sizeof(hash_dir)
+				 + n * sizeof(hash_table *)
+				 + sht->nhazards * sizeof(hz_ct);
+	hash_dir *d = alloc_mem(sht->region, dsize);
+	if (!d) {
+		return 0;
+	}
+	memset(d, 0, dsize);
+	d->depth = depth;
+	d->hazard_start = (hz_ct *)(d->segs + n);
+	return d;
+}
+
+static inline size_t dir_entries(const hash_dir *d) {
+	return (size_t)1 << d->depth;
+}
+
+static inline size_t seg_index(const hash_dir *d, uint64_t keyh) {
+	return d->depth ? keyh >> (64 - d->depth) : 0;
+}
+
+//entries pointing to the segment at idx, and the first of them
+static inline size_t seg_run(const hash_dir *d, size_t idx) {
+	return (size_t)1 << (d->depth - d->segs[idx]->depth);
+}
+
+static inline size_t seg_start(const hash_dir *d, size_t idx) {
+	return idx & ~(seg_run(d, idx) - 1);
+}
+
+static void dir_set_run(hash_dir *d, size_t idx, hash_table *seg) {
+	size_t start = seg_start(d, idx);
+	size_t run = seg_run(d, idx);
+	for (size_t i = 0; i < run; i++) {
+		d->segs[start + i] = seg;
+	}
+}
+
+static hash_dir *copy_dir(shared_hash_table *sht, const hash_dir *d) {
+	hash_dir *nd = create_dir(sht, d->depth);
+	if (nd) {
+		memcpy(nd->segs, d->segs, dir_entries(d) * sizeof(hash_table *));
+	}
+	return nd;
+}
+
+//a copy of d with the segment at idx split between lo and hi,
+//doubling the directory if that segment was as deep as it
+static hash_dir *dir_with_split(shared_hash_table *sht,
+								const hash_dir *d,
+								size_t idx,
+								hash_table *lo,
+								hash_table *hi) {
+	hash_table *old = d->segs[idx];
+	uint64_t depth = old->depth == d->depth ? d->depth + 1 : d->depth;
+	hash_dir *nd = create_dir(sht, depth);
+	if (!nd) {
+		return 0;
+	}
+	size_t shift = depth - d->depth;
+	size_t n = dir_entries(nd);
+	for (size_t i = 0; i < n; i++) {
+		nd->segs[i] = d->segs[i >> shift];
+	}
+	size_t start = seg_start(d, idx) << shift;
+	size_t run = (size_t)1 << (depth - old->depth);
+	for (size_t i = 0; i < run; i++) {
+		nd->segs[start + i] = i < run / 2 ? lo : hi;
+	}
+	return nd;
+}
+
+static size_t round_pow2(size_t n, size_t lo, size_t hi) {
+	size_t r = lo;
+	while (r < n && r < hi) {
+		r *= 2;
+	}
+	return r;
+}
+
+void default_policy(struct table_policy *p) {
+	p->probes = hash_load;
+	p->growth = def_growth;
+	p->shrink_ratio = desize_rat;
+	p->rehash_ratio = rehash_rat;
+	p->target_load = def_target_load;
+	p->start_size = def_start;
+	p->seg_elems = def_seg_elems;
+	p->auto_tune = 0;
+}
+
+//sizes are made powers of two, the rest is kept in bounds
+static void clamp_policy(struct table_policy *to, const struct table_policy *p) {
+	*to = *p;
+	if (to->probes < 1) {
+		to->probes = 1;
+	}
+	if (to->probes > max_probes) {
+		to->probes = max_probes;
+	}
+	to->growth = round_pow2(to->growth, 2, max_growth);
+	if (to->rehash_ratio < 1) {
+		to->rehash_ratio = 1;
+	}
+	if (to->shrink_ratio <= to->rehash_ratio) {
+		to->shrink_ratio = to->rehash_ratio + 1;
+	}
+	if (to->target_load < 1 || to->target_load > 100) {
+		to->target_load = def_target_load;
+	}
+	to->start_size = round_pow2(to->start_size, 8, (size_t)1 << 40);
+	to->seg_elems = round_pow2(to->seg_elems, 64, (size_t)1 << 40);
+}
+
+static shared_hash_table *init_tbl(hashfn_type hashfn,
+								   compfn_type compfn,
+								   const struct table_policy *p,
+								   shm_region *r) {
 	size_t nhaz = 8;
 	struct shared_hash_table *sht;
-	sht = malloc(sizeof(*sht) + nhaz * sizeof(hz_st));
+	sht = alloc_mem(r, sizeof(*sht) + nhaz * sizeof(hz_st));
+	if (!sht) {
+		return 0;
+	}
 	memset(sht, 0, sizeof(*sht));
 	for (size_t i = 0; i < nhaz; i++) {
 		sht->hazard_refs[i].nactive = 0;
+		sht->hazard_refs[i].blocked_since = 0;
+		sht->hazard_refs[i].lookups = 0;
+		sht->hazard_refs[i].probes = 0;
 	}
-	sht->current_table = create_ht(nstart, nhaz);
-	sht->current_table->salt = avalanche64(nstart*nhaz, 0);
 	sht->nhazards = nhaz;
 	sht->hashfn = hashfn;
 	sht->compfn = compfn;
-	sht->old_tables = 0;
+	sht->region = r;
+	sht->epoch = now_secs();
+	//so a table made where a freed one was can't match its hot entries
+	sht->generation = new_salt() & ~(uint64_t)1;
+	sht->old_dirs = 0;
+	clamp_policy(&sht->policy, p);
+	hash_dir *d = create_dir(sht, 0);
+	hash_table *ht = create_ht(sht->policy.start_size, r);
+	if (!d || !ht) {
+		if (d) {
+			free_mem(r, d);
+		}
+		if (ht) {
+			free_mem(r, ht);
+		}
+		free_mem(r, sht);
+		return 0;
+	}
+	ht->salt = new_salt();
+	ht->probes = sht->policy.probes;
+	d->segs[0] = ht;
+	sht->current_dir = d;
 	atomic_barrier(mem_release);
 	return sht;
 }
 
-static char acquire_write(shared_hash_table *sht) {
-	if (sht->access == 0) {
-		if (!atomic_exchange(sht->access, 1, mem_acquire)) {
-			sht->timestamp++;
-			return 1;
+shared_hash_table *create_tbl(hashfn_type hashfn, compfn_type compfn) {
+	struct table_policy p;
+	default_policy(&p);
+	return init_tbl(hashfn, compfn, &p, 0);
+}
+
+shared_hash_table *create_tbl_policy(hashfn_type hashfn,
+									 compfn_type compfn,
+									 const struct table_policy *p) {
+	return init_tbl(hashfn, compfn, p, 0);
+}
+
+shared_hash_table *create_shm_tbl(const char *name,
+								  size_t nbytes,
+								  void *at,
+								  hashfn_type hashfn,
+								  compfn_type compfn,
+								  char replace) {
+	if (!at) {
+		return 0;
+	}
+	//a region already there may still have a writer,
+	//only the caller can know it was left from a crash
+	if (replace) {
+		shm_unlink(name);
+	}
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0) {
+		return 0;
+	}
+	if (ftruncate(fd, nbytes) != 0) {
+		close(fd);
+		shm_unlink(name);
+		return 0;
+	}
+	//readers map the region where the writer has it, so the caller
+	//picks an address it knows is free in every process
+	char *base = mmap(at, nbytes, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	close(fd);
+	if (base != at) {
+		if (base != MAP_FAILED) {
+			munmap(base, nbytes);
 		}
+		shm_unlink(name);
+		return 0;
 	}
-	return 0;
+	shm_region *r = (shm_region *)base;
+	r->base = base;
+	r->size = nbytes;
+	//the rest of the region starts out as one free block
+	size_t first = (sizeof(*r) + shm_block_hdr - 1) & ~(size_t)(shm_block_hdr - 1);
+	r->end = nbytes & ~(size_t)(shm_block_hdr - 1);
+	if (r->end < first + shm_min_block) {
+		munmap(base, nbytes);
+		shm_unlink(name);
+		return 0;
+	}
+	push_free(r, (shm_block *)(base + first), r->end - first, blk_prev_used);
+	struct table_policy p;
+	default_policy(&p);
+	shared_hash_table *sht = init_tbl(hashfn, compfn, &p, r);
+	if (!sht) {
+		munmap(base, nbytes);
+		shm_unlink(name);
+		return 0;
+	}
+	r->sht = sht;
+	//readers check the magic before touching anything else
+	atomic_store(r->magic, shm_magic, mem_release);
+	return sht;
+}
+
+shm_handle *attach_shm_tbl(const char *name,
+						   hashfn_type hashfn,
+						   compfn_type compfn) {
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		return 0;
+	}
+	shm_region *hdr = mmap(0, sizeof(*hdr), PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	char *want = 0;
+	size_t nbytes = 0;
+	if (atomic_load(hdr->magic, mem_acquire) == shm_magic) {
+		want = hdr->base;
+		nbytes = hdr->size;
+	}
+	munmap(hdr, sizeof(*hdr));
+	if (!want) {
+		close(fd);
+		return 0;
+	}
+	char *base = mmap(want, nbytes, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return 0;
+	}
+	//the writer's address is taken here, can't use the region
+	if (base != want) {
+		munmap(base, nbytes);
+		return 0;
+	}
+	shm_handle *h = malloc(sizeof(*h));
+	if (!h) {
+		munmap(base, nbytes);
+		return 0;
+	}
+	h->sht = ((shm_region *)base)->sht;
+	h->hashfn = hashfn;
+	h->compfn = compfn;
+	return h;
+}
+
+void detach_shm_tbl(shm_handle *h) {
+	shm_region *r = h->sht->region;
+	munmap(r->base, r->size);
+	free(h);
+}
+
+//the table this thread has to itself, so callbacks run under the
+//write lock can still allocate in its region
+static thread_l const shared_hash_table *holding_write;
+
+static char acquire_write(shared_hash_table *sht) {
+	size_t cur = atomic_load(sht->access, mem_relaxed);
+	if (cur & write_excl) {
+		return 0;
+	}
+	//seq_cst against acquire_shared, so either the shared writer
+	//sees the bit or this sees it inside
+	if (!atomic_cas(sht->access, cur, write_excl, mem_seq_cst)) {
+		return 0;
+	}
+	//no new shared writers get in now, wait out the ones inside
+	for (size_t i = 0; i < count_shards; i++) {
+		while (atomic_load(sht->writers[i].inside, mem_seq_cst)) {}
+	}
+	sht->timestamp++;
+	holding_write = sht;
+	return 1;
 }
 
 static void release_write(shared_hash_table *sht) {
+	holding_write = 0;
 	atomic_store(sht->access, 0, mem_release);
 }
 
-static hash_table *acquire_table(shared_hash_table *tbl, size_t id) {
+//the region allocator belongs to the writer, so callers
+//take the table like any other write
+void *shm_alloc(shared_hash_table *sht, size_t nbytes) {
+	if (holding_write == sht) {
+		return alloc_mem(sht->region, nbytes);
+	}
+	while (!acquire_write(sht)) {}
+	void *p = alloc_mem(sht->region, nbytes);
+	release_write(sht);
+	return p;
+}
+
+void shm_free(shared_hash_table *sht, void *tof) {
+	if (holding_write == sht) {
+		free_mem(sht->region, tof);
+		return;
+	}
+	while (!acquire_write(sht)) {}
+	free_mem(sht->region, tof);
+	release_write(sht);
+}
+
+static size_t shard_ctr;
+static thread_l size_t my_shard = SIZE_MAX;
+
+static inline size_t thread_shard() {
+	if (my_shard == SIZE_MAX) {
+		my_shard = atomic_fetch_add(shard_ctr, 1, mem_relaxed) % count_shards;
+	}
+	return my_shard;
+}
+
+//shared writers only ever claim free slots and tombstone live ones,
+//anything which moves items around needs the table to itself.
+//they count themselves in their thread's shard, so they only share
+//a line with a writer wanting the table to itself
+static char acquire_shared(shared_hash_table *sht) {
+	writer_shard *w = &sht->writers[thread_shard()];
+	atomic_fetch_add(w->inside, 1, mem_seq_cst);
+	if (atomic_load(sht->access, mem_seq_cst) & write_excl) {
+		atomic_fetch_sub(w->inside, 1, mem_release);
+		return 0;
+	}
+	return 1;
+}
+
+static void release_shared(shared_hash_table *sht) {
+	atomic_fetch_sub(sht->writers[thread_shard()].inside, 1, mem_release);
+}
+
+static hash_dir *acquire_table(shared_hash_table *tbl, size_t id) {
 
 	//tbl is assumed to be unchanging ever
 
@@ -318,10 +1110,10 @@ static hash_table *acquire_table(shared_hash_table *tbl, size_t id) {
 	//to happen before this operation
 	atomic_fetch_add(tbl->hazard_refs[id].nactive, 1, mem_acquire);
 
-	hash_table *mytbl = atomic_load(tbl->current_table, mem_relaxed);
+	hash_dir *mydir = atomic_load(tbl->current_dir, mem_relaxed);
 	consume_barrier;
 
-	return mytbl;
+	return mydir;
 }
 
 static void release_table(shared_hash_table *tbl, size_t id) {
@@ -331,9 +1123,9 @@ static void release_table(shared_hash_table *tbl, size_t id) {
 	atomic_fetch_sub(tbl->hazard_refs[id].nactive, 1, mem_release);
 }
 
-static char update_del(shared_hash_table *tbl, hash_table *htbl) {
+static char update_del(shared_hash_table *tbl, hash_dir *dir) {
 	hz_st *href = tbl->hazard_refs;
-	hz_ct *ohz = htbl->hazard_start;
+	hz_ct *ohz = dir->hazard_start;
 	size_t nhz = tbl->nhazards;
 	char del = 1;
 	for (size_t i = 0; i < nhz; i++) {
@@ -341,9 +1133,13 @@ static char update_del(shared_hash_table *tbl, hash_table *htbl) {
 			if (!href[i].nactive) {
 				atomic_barrier(mem_acquire);
 				ohz[i] = 0;
+				href[i].blocked_since = 0;
 			}
 			else {
 				del = 0;
+				if (!href[i].blocked_since) {
+					href[i].blocked_since = now_secs();
+				}
 			}
 		}
 	}
@@ -352,67 +1148,110 @@ static char update_del(shared_hash_table *tbl, hash_table *htbl) {
 	return del;
 }
 
+//frees a table no reader can see anymore, and with it
+//the values evicted from it
+static void retire_htable(shared_hash_table *sht, hash_table *ht) {
+	if (sht->evictfn && ht->meta) {
+		for (item *it = ht->cleanup_with_me; it; it = it->next) {
+			if (meta_of(ht, it)->evicted) {
+				sht->evictfn(it->keyp, it->data, sht->evict_params);
+			}
+		}
+	}
+	free_htable(ht);
+}
+
+//frees a directory no reader can see anymore,
+//with the segments only it pointed to
+static void retire_dir(shared_hash_table *sht, hash_dir *d) {
+	message *m = d->pushed;
+	while (m) {
+		message *nxt = m->next;
+		if (m->data) {
+			d->delfn(m->key, m->data, d->del_params);
+		}
+		free(m);
+		m = nxt;
+	}
+	free(d->pushed_keys);
+	hash_table *seg = d->dead_segs;
+	while (seg) {
+		hash_table *nxt = seg->next;
+		retire_htable(sht, seg);
+		seg = nxt;
+	}
+	sht->retired_bytes -= d->retired;
+	free_mem(sht->region, d);
+}
+
 void clear_tables(shared_hash_table *sht) {
 	//first pop off the top
-	hash_table *ntop = sht->old_tables;
-	hash_table *ctbl = sht->old_tables;
-	while (ctbl) {
-		hash_table *nxt = ctbl->next;
-		if (update_del(sht, ctbl)) {
-			free_htable(ctbl);
+	hash_dir *ntop = sht->old_dirs;
+	hash_dir *cdir = sht->old_dirs;
+	while (cdir) {
+		hash_dir *nxt = cdir->next;
+		if (update_del(sht, cdir)) {
+			retire_dir(sht, cdir);
 			ntop = nxt;
-			ctbl = nxt;
+			cdir = nxt;
 		}
 		else {
 			break;
 		}
 	}
-	sht->old_tables = ntop;
+	sht->old_dirs = ntop;
 
-	//go through the list and clear/update tables left in the middle
+	//go through the list and clear/update directories left in the middle
 	if (ntop) {
-		hash_table *prev_t = ntop;
-		ctbl = ntop->next;
-		while (ctbl) {
-			hash_table *nxt = ctbl->next;
-			if (update_del(sht, ctbl)) {
-				free_htable(ctbl);
-				prev_t->next = nxt;
+		hash_dir *prev_d = ntop;
+		cdir = ntop->next;
+		while (cdir) {
+			hash_dir *nxt = cdir->next;
+			if (update_del(sht, cdir)) {
+				retire_dir(sht, cdir);
+				prev_d->next = nxt;
 			}
 			else {
-				prev_t = ctbl;
+				prev_d = cdir;
 			}
-			ctbl = nxt;
+			cdir = nxt;
 		}
 	}
 }
 
-static void update_table(shared_hash_table *sht, hash_table *ht) {
+//publishes nd. dead is the list of segments which were
+//replaced in nd, they go with the directory being retired
+static void update_table(shared_hash_table *sht, hash_dir *nd, hash_table *dead) {
 	//no barrier since this thread is the only one making changes
-	//so this thread will see all updates to current table
-	hash_table *old = sht->current_table;
+	//so this thread will see all updates to current directory
+	hash_dir *old = sht->current_dir;
+
+	//a reader which sees neither the hazard snapshot nor this
+	//can't still be using a hot entry into old
+	atomic_fetch_add(sht->generation, 1, mem_relaxed);
 
 	//release on the store to prevent
 	//any previous working from being reordered here
-	atomic_store(sht->current_table, ht, mem_release);
+	atomic_store(sht->current_dir, nd, mem_release);
 
 
 	//For this, we need a store-load barrier,
 	//which is only provided by mem_seq_cst
-	//To prevent the store to current_table
+	//To prevent the store to current_dir
 	//from being reordered with the loads from the
 	//current hazard table
 	atomic_barrier(mem_seq_cst);
 	//once this point is reached, it is impossible for a
 	//reader which has not signed the hazards table yet
-	//to see the older version of the hash table
+	//to see the older version of the directory
 	//why? Any thread which has not signed the hazard table
-	//yet will view the new table upon loading.
-	//In fact, any thread which has not actually loaded the table yet
+	//yet will view the new directory upon loading.
+	//In fact, any thread which has not actually loaded it yet
 	//will see the new one, at this point.
 	//As a result, any new signatures
 	//that race with this copy will all be seeing
 	//the new version of the pointer.
+	atomic_fetch_add(sht->generation, 1, mem_release);
 	hz_ct hasv = 0;
 	for (size_t i = 0; i < sht->nhazards; i++) {
 		//can do relaxed loads, thanks to the barrier
@@ -421,44 +1260,218 @@ static void update_table(shared_hash_table *sht, hash_table *ht) {
 		hasv |= cur; //see if there are any active
 		old->hazard_start[i] = cur;
 	}
-	//try to clear out existing tables
+	old->dead_segs = dead;
+	old->retired = dir_bytes(sht, old);
+	for (hash_table *seg = dead; seg; seg = seg->next) {
+		old->retired += seg_bytes(seg);
+	}
+	sht->retired_bytes += old->retired;
+	//try to clear out existing directories
 
 	clear_tables(sht);
 
 	if (!hasv) {
-		free_htable(old);
+		retire_dir(sht, old);
 	}
 	else {
 		//put it in the list!
 		//do some things with it...
-		old->next = sht->old_tables;
-		sht->old_tables = old;
+		old->next = sht->old_dirs;
+		sht->old_dirs = old;
 	}
 }
 
-void try_clean_mem(shared_hash_table *sh) {
-	clear_tables(sh);
+/****
+* retired memory
+*/
+
+//the reader which has held back retired memory the longest, or -1
+static long stalled_id(shared_hash_table *sht, uint64_t *secs) {
+	long id = -1;
+	uint64_t since = 0;
+	for (size_t i = 0; i < sht->nhazards; i++) {
+		uint64_t cur = sht->hazard_refs[i].blocked_since;
+		if (cur && (id < 0 || cur < since)) {
+			id = i;
+			since = cur;
+		}
+	}
+	*secs = id < 0 ? 0 : now_secs() - since;
+	return id;
 }
 
-void clean_all_mem(shared_hash_table *sh) {
-	while (sh->old_tables) {
-		clear_tables(sh);
+//what a resize does about the retired memory limit
+typedef enum room_action {
+	room_ok,
+	room_defer,
+	room_fail
+} room_action;
+
+//whether bytes more can be retired without going over the limit.
+//At the limit the policy either waits here for readers to let go,
+//or has the caller defer or fail. If nothing is held back anymore
+//there's nothing to wait for, and the resize goes ahead
+static room_action retire_room(shared_hash_table *sht, size_t bytes) {
+	if (!sht->retired_max) {
+		return room_ok;
+	}
+	long wait = retire_wait_min;
+	for (;;) {
+		if (sht->retired_bytes + bytes <= sht->retired_max) {
+			return room_ok;
+		}
+		clear_tables(sht);
+		if (!sht->old_dirs
+			|| sht->retired_bytes + bytes <= sht->retired_max) {
+			return room_ok;
+		}
+		uint64_t secs;
+		long id = stalled_id(sht, &secs);
+		retire_action act = retire_fail;
+		if (sht->retirefn) {
+			act = sht->retirefn(id, secs, sht->retire_params);
+		}
+		if (act == retire_defer) {
+			return room_defer;
+		}
+		if (act != retire_block) {
+			return room_fail;
+		}
+		//readers don't need the writer for anything to let go,
+		//this only keeps from spinning on retirefn
+		struct timespec ts = {0, wait};
+		nanosleep(&ts, NULL);
+		if (wait < retire_wait_max) {
+			wait *= 2;
+		}
+	}
+}
+
+/****
+* change feed
+*/
+
+char enable_change_feed(shared_hash_table *sht, size_t capacity) {
+	size_t cap = 1;
+	while (cap < capacity) {
+		cap *= 2;
+	}
+	while (!acquire_write(sht)) {}
+	if (sht->feed) {
+		release_write(sht);
+		return 1;
+	}
+	//records point at keys, and copied ones are freed with their segment
+	if (sht->current_dir->segs[0]->keylen) {
+		release_write(sht);
+		return 0;
+	}
+	size_t fsize = sizeof(change_feed) + cap * sizeof(change_rec);
+	change_feed *f = alloc_mem(sht->region, fsize);
+	if (f) {
+		memset(f, 0, fsize);
+		f->capacity = cap;
+		atomic_store(sht->feed, f, mem_release);
+	}
+	release_write(sht);
+	return f != 0;
+}
+
+//writes a record which followers can't see until publish_changes
+static void log_change(shared_hash_table *sht,
+					   message_type mtype,
+					   const void *key,
+					   void *data) {
+	change_feed *f = sht->feed;
+	if (!f) {
+		return;
+	}
+	uint64_t seq = ++f->head;
+	change_rec *rec = &f->recs[seq & (f->capacity - 1)];
+	atomic_store(rec->seq, 0, mem_relaxed);
+	//keeps the field stores from moving above the zeroing
+	atomic_barrier(mem_release);
+	rec->key = key;
+	rec->data = data;
+	rec->mtype = mtype;
+	atomic_store(rec->seq, seq, mem_release);
+}
+
+static void publish_changes(shared_hash_table *sht) {
+	change_feed *f = sht->feed;
+	if (f) {
+		atomic_store(f->last, f->head, mem_release);
+	}
+}
+
+uint64_t change_feed_seq(shared_hash_table *sht) {
+	change_feed *f = atomic_load(sht->feed, mem_acquire);
+	return f ? atomic_load(f->last, mem_acquire) : 0;
+}
+
+uint64_t read_changes(shared_hash_table *sht,
+					  uint64_t from_seq,
+					  changefn_type fn,
+					  void *params) {
+	change_feed *f = atomic_load(sht->feed, mem_acquire);
+	if (!f) {
+		return 0;
+	}
+	if (from_seq == 0) {
+		from_seq = 1;
+	}
+	uint64_t last = atomic_load(f->last, mem_acquire);
+	if (from_seq > last) {
+		return from_seq;
+	}
+	if (last - from_seq >= f->capacity) {
+		return 0;
+	}
+	for (uint64_t seq = from_seq; seq <= last; seq++) {
+		change_rec *rec = &f->recs[seq & (f->capacity - 1)];
+		//everything up to last was completely written once,
+		//so any other sequence means the writer lapped us
+		if (atomic_load(rec->seq, mem_acquire) != seq) {
+			return 0;
+		}
+		const void *key = rec->key;
+		void *data = rec->data;
+		message_type mtype = rec->mtype;
+		atomic_barrier(mem_acquire);
+		if (atomic_load(rec->seq, mem_relaxed) != seq) {
+			return 0;
+		}
+		fn(seq, mtype == remove_item, key, data, params);
 	}
+	return last + 1;
+}
+
+//the ring is in the region, and the records point at what's in it
+uint64_t shm_change_feed_seq(shm_handle *h) {
+	return change_feed_seq(h->sht);
+}
+
+uint64_t shm_read_changes(shm_handle *h,
+						  uint64_t from_seq,
+						  changefn_type fn,
+						  void *params) {
+	return read_changes(h->sht, from_seq, fn, params);
 }
 
 
 
-static inline item *insert_into(item *elems,
-								uint64_t n_elems,
-						    	uint64_t salt,
-						    	uint64_t key,
-						    	const void *keyp,
-						    	compfn_type cmp) {
+//returns the slot for key, _exists if it's already there,
+//or 0 if both probes and the stash are taken.
+//the key is mixed with the salt even for the first probe,
+//so a chosen set of keys can't all be aimed at one slot
+static inline item *insert_into(const hash_table *ht,
+								uint64_t key,
+								const void *keyp,
+								compfn_type cmp) {
 	uint64_t lkey = key;
-	int nbad = 0;
-	for (size_t i = 0; i < hash_load; i++) {
-		uint64_t act_key = lkey & (n_elems - 1);
-		item *item_at = &elems[act_key];
+	for (size_t i = 0; i < ht->probes; i++) {
+		lkey = avalanche64(lkey, ht->salt);
+		item *item_at = &ht->elems[lkey & (ht->n_elements - 1)];
 		if (test_empty(item_at->key)) {
 			return item_at;
 		}
@@ -467,150 +1480,1339 @@ static inline item *insert_into(item *elems,
 				 && cmp && cmp(item_at->keyp, keyp)) {
 			return _exists;
 		}
-		lkey = avalanche64(lkey, salt);
+	}
+	//slots never go back to empty, so a key can only be in the
+	//stash if both probes were taken. Only then must it be searched
+	if (cmp) {
+		for (size_t i = 0; i < ht->stash_count; i++) {
+			item *item_at = &ht->stash[i];
+			if (item_at->key == key && cmp(item_at->keyp, keyp)) {
+				return _exists;
+			}
+		}
+	}
+	if (ht->stash_count < stash_size) {
+		return &ht->stash[ht->stash_count];
 	}
 	return 0;
 }
 
-static inline item *lookup_exist(item *elems,
-							     uint64_t n_elems,
-							     uint64_t salt,
-							     uint64_t keyh,
-							     const void *key,
-							     compfn_type cmp) {
+//call once a slot from insert_into has been filled
+static inline void commit_slot(hash_table *ht, item *item_at) {
+	if (item_at >= ht->stash) {
+		atomic_store(ht->stash_count, ht->stash_count + 1, mem_release);
+	}
+}
+
+//nprobes gets the number of slots looked at
+static inline item *lookup_probes(const hash_table *ht,
+								  uint64_t keyh,
+								  const void *key,
+								  compfn_type cmp,
+								  size_t *nprobes) {
 	uint64_t lkey = keyh;
-	for (size_t i = 0; i < hash_load; i++) {
-		uint64_t act_key = lkey & (n_elems - 1);
-		item *item_at = &elems[act_key];
+	size_t probes = ht->probes;
+	for (size_t i = 0; i < probes; i++) {
+		lkey = avalanche64(lkey, ht->salt);
+		item *item_at = &ht->elems[lkey & (ht->n_elements - 1)];
 		if (has_elem(item_at->key)
 			&& cmp(item_at->keyp, key)) {
+			*nprobes = i + 1;
+			return item_at;
+		}
+	}
+	size_t nstash = atomic_load(ht->stash_count, mem_acquire);
+	for (size_t i = 0; i < nstash; i++) {
+		item *item_at = &ht->stash[i];
+		if (item_at->key == keyh && cmp(item_at->keyp, key)) {
+			*nprobes = probes + i + 1;
 			return item_at;
 		}
-		lkey = avalanche64(lkey, salt);
 	}
+	*nprobes = probes + nstash;
 	return 0;
 }
 
-static hash_table *resize_into(const hash_table *ht, uint64_t salt, int all_bigger) {
+static inline item *lookup_exist(const hash_table *ht,
+								 uint64_t keyh,
+								 const void *key,
+								 compfn_type cmp) {
+	size_t nprobes;
+	return lookup_probes(ht, keyh, key, cmp, &nprobes);
+}
+
+static inline void copy_item(item *item_at, const item *celem) {
+	//this can't be equal to exists!
+	//uniqueness is already know at here!
+	item_at->key = celem->key;
+	item_at->data = celem->data;
+	item_at->keyp = celem->keyp;
+}
+
+static inline void copy_meta(hash_table *to, item *item_at,
+							 const hash_table *from, const item *celem) {
+	if (to->meta) {
+		meta_of(to, item_at)->expires = meta_of(from, celem)->expires;
+	}
+}
+
+/****
+* parallel rehashing
+*/
+
+//each helper takes a range of the old table's slots and claims slots
+//in the new one with a cas on the key, since they race each other.
+//the new table isn't published until every helper is joined
+typedef struct rehash_part {
+	const hash_table *from;
+	hash_table *to;
+	size_t start;
+	size_t end;
+	uint64_t mask;
+	uint64_t match;
+	size_t count;
+	item *active_l;
+	item *active_tail;
+	key_chunk *keys; //each helper copies keys into its own chunks
+	char *failed;
+} rehash_part;
+
+static item *claim_slot(hash_table *ht, uint64_t key) {
+	uint64_t lkey = key;
+	for (size_t i = 0; i < ht->probes; i++) {
+		lkey = avalanche64(lkey, ht->salt);
+		item *item_at = &ht->elems[lkey & (ht->n_elements - 1)];
+		uint64_t empty = 0;
+		if (atomic_cas(item_at->key, empty, key, mem_relaxed)) {
+			return item_at;
+		}
+	}
+	//overshooting stash_count is fine, the table gets thrown out
+	size_t at = atomic_fetch_add(ht->stash_count, 1, mem_relaxed);
+	if (at < stash_size) {
+		ht->stash[at].key = key;
+		return &ht->stash[at];
+	}
+	return 0;
+}
+
+static void *rehash_range(void *arg) {
+	rehash_part *p = arg;
+	for (size_t i = p->start; i < p->end; i++) {
+		//someone failed, the whole table is lost anyways
+		if ((i & 1023) == 0 && atomic_load(*p->failed, mem_relaxed)) {
+			return 0;
+		}
+		const item *celem = &p->from->elems[i];
+		if (has_elem(celem->key) && (celem->key & p->mask) == p->match) {
+			item *item_at = claim_slot(p->to, celem->key);
+			if (!item_at) {
+				atomic_store(*p->failed, 1, mem_relaxed);
+				return 0;
+			}
+			//the claim stored the key, and other helpers' cas may be
+			//reading it, so it isn't written again
+			item_at->data = celem->data;
+			item_at->keyp = celem->keyp;
+			copy_meta(p->to, item_at, p->from, celem);
+			if (p->to->keylen) {
+				item_at->keyp = copy_key(p->to, &p->keys, celem->keyp);
+				if (!item_at->keyp) {
+					atomic_store(*p->failed, 1, mem_relaxed);
+					return 0;
+				}
+			}
+			if (!p->active_l) {
+				p->active_tail = item_at;
+			}
+			item_at->iter_next = p->active_l;
+			p->active_l = item_at;
+			p->count++;
+		}
+	}
+	return 0;
+}
+
+//helper threads kept with the table, asleep between rehashes. The
+//writer hands out one rehash's parts at a time and takes parts itself,
+//so a rehash never waits on a helper that hasn't woken up yet
+typedef struct rehash_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	rehash_part *parts;
+	size_t nparts;
+	size_t next; //first part nobody has taken
+	size_t busy; //parts taken and not finished
+	char stop;
+	size_t runs; //rehashes split up, kept over pool changes
+	size_t nhelpers;
+	pthread_t helpers[];
+} rehash_pool;
+
+static void *pool_helper(void *arg) {
+	rehash_pool *pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->next == pool->nparts) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (pool->stop) {
+			break;
+		}
+		rehash_part *p = &pool->parts[pool->next++];
+		pool->busy++;
+		pthread_mutex_unlock(&pool->lock);
+		rehash_range(p);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0 && pool->next == pool->nparts) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+static void stop_pool(rehash_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (size_t i = 0; i < pool->nhelpers; i++) {
+		pthread_join(pool->helpers[i], NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool);
+}
+
+//returns 0 if not a single helper could be started
+static rehash_pool *start_pool(size_t nhelpers) {
+	rehash_pool *pool = malloc(sizeof(*pool) + nhelpers * sizeof(pthread_t));
+	if (!pool) {
+		return 0;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->parts = 0;
+	pool->nparts = pool->next = pool->busy = 0;
+	pool->stop = 0;
+	pool->runs = 0;
+	pool->nhelpers = 0;
+	for (size_t i = 0; i < nhelpers; i++) {
+		if (pthread_create(&pool->helpers[i], NULL, pool_helper, pool)) {
+			break;
+		}
+		pool->nhelpers++;
+	}
+	if (!pool->nhelpers) {
+		stop_pool(pool);
+		return 0;
+	}
+	return pool;
+}
+
+//returns once every part is done, by the writer or a helper
+static void run_parts(rehash_pool *pool, rehash_part *parts, size_t nparts) {
+	pthread_mutex_lock(&pool->lock);
+	pool->parts = parts;
+	pool->nparts = nparts;
+	pool->next = 0;
+	pool->runs++;
+	pthread_cond_broadcast(&pool->work);
+	while (pool->next < pool->nparts) {
+		rehash_part *p = &pool->parts[pool->next++];
+		pool->busy++;
+		pthread_mutex_unlock(&pool->lock);
+		rehash_range(p);
+		pthread_mutex_lock(&pool->lock);
+		pool->busy--;
+	}
+	while (pool->busy) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pool->parts = 0;
+	pool->nparts = pool->next = 0;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static char rehash_parallel(const hash_table *ht,
+							hash_table *ntbl,
+							rehash_pool *pool,
+							uint64_t mask,
+							uint64_t match) {
+	rehash_part parts[max_rehash_threads];
+	size_t nthreads = pool->nhelpers + 1;
+	char failed = 0;
+	//elems and the stash are contiguous
+	size_t total = ht->n_elements + stash_size;
+	size_t per = (total + nthreads - 1) / nthreads;
+	for (size_t i = 0; i < nthreads; i++) {
+		rehash_part *p = &parts[i];
+		p->from = ht;
+		p->to = ntbl;
+		p->start = i * per < total ? i * per : total;
+		p->end = p->start + per < total ? p->start + per : total;
+		p->mask = mask;
+		p->match = match;
+		p->count = 0;
+		p->active_l = p->active_tail = 0;
+		p->keys = 0;
+		p->failed = &failed;
+	}
+	run_parts(pool, parts, nthreads);
+	//hand every helper's chunks to the table, so they're freed with it
+	for (size_t i = 0; i < nthreads; i++) {
+		key_chunk *kc = parts[i].keys;
+		while (kc) {
+			key_chunk *nxt = kc->next;
+			kc->next = ntbl->keys;
+			ntbl->keys = kc;
+			kc = nxt;
+		}
+	}
+	if (failed) {
+		return 0;
+	}
+	if (ntbl->stash_count > stash_size) {
+		ntbl->stash_count = stash_size;
+	}
+	for (size_t i = 0; i < nthreads; i++) {
+		ntbl->active_count += parts[i].count;
+		if (parts[i].active_l) {
+			parts[i].active_tail->iter_next = ntbl->active_l;
+			ntbl->active_l = parts[i].active_l;
+		}
+	}
+	return 1;
+}
+
+//copies the live items of ht whose hash matches under mask into
+//a fresh segment of n_el slots, one level deeper if mask splits ht.
+//returns 0 if any of them, or the pending key, can't be placed
+static hash_table *rehash_into(const shared_hash_table *sht,
+							   const hash_table *ht,
+							   size_t n_el,
+							   uint64_t salt,
+							   uint64_t pending,
+							   uint64_t mask,
+							   uint64_t match) {
+	rehash_pool *pool = sht->pool;
+	hash_table *ntbl = create_ht(n_el, ht->region);
+	if (!ntbl) {
+		return 0;
+	}
+	ntbl->salt = salt;
+	ntbl->probes = sht->policy.probes;
+	ntbl->depth = mask ? ht->depth + 1 : ht->depth;
+	ntbl->keylen = ht->keylen;
+	if (ht->meta && !add_meta(ntbl)) {
+		free_htable(ntbl);
+		return 0;
+	}
+	//the region allocator isn't thread safe, so helpers can't copy keys into it
+	if (ht->keylen && ht->region) {
+		pool = 0;
+	}
+	if (pool && ht->n_elements >= par_rehash_min) {
+		if (!rehash_parallel(ht, ntbl, pool, mask, match)) {
+			free_htable(ntbl);
+			return 0;
+		}
+	}
+	else {
+		for (size_t l = 0; l < active_lists; l++) {
+			for (item *celem = active_list(ht, l); celem; celem = celem->iter_next) {
+				if (!has_elem(celem->key) || (celem->key & mask) != match) {
+					continue;
+				}
+				item *item_at = insert_into(ntbl, celem->key, NULL, NULL);
+				if (!item_at) {
+					free_htable(ntbl);
+					return 0;
+				}
+				copy_item(item_at, celem);
+				copy_meta(ntbl, item_at, ht, celem);
+				//compacts the arena, removed keys aren't copied
+				if (ntbl->keylen) {
+					item_at->keyp = copy_key(ntbl, &ntbl->keys, celem->keyp);
+					if (!item_at->keyp) {
+						free_htable(ntbl);
+						return 0;
+					}
+				}
+				item_at->iter_next = ntbl->active_l;
+				ntbl->active_l = item_at;
+				commit_slot(ntbl, item_at);
+				ntbl->active_count++;
+			}
+		}
+	}
+	ntbl->start_live = ntbl->active_count;
+	if (pending && !insert_into(ntbl, pending, NULL, NULL)) {
+		free_htable(ntbl);
+		return 0;
+	}
+	return ntbl;
+}
+
+//pending is a hash which must also fit into the new segment, or 0.
+//min_elements lets a caller that knows what's coming (batches)
+//size the segment once instead of growing through it.
+//growth is bounded: once the segment has grown by max_grow in all
+//only the salt changes, and after max_resize_tries this gives up
+//and returns 0
+static hash_table *resize_into(const shared_hash_table *sht,
+							   const hash_table *ht,
+							   uint64_t pending,
+							   size_t min_elements,
+							   int all_bigger) {
+	const struct table_policy *p = &sht->policy;
 	size_t newer_elements = ht->n_elements;
-	uint64_t new_salt = ht->salt;
 	hash_table *ntbl = 0;
 	int inc_size = 1;
-	if (!all_bigger) {
-		if (ht->active_count < (ht->n_elements/desize_rat)) {
+	size_t grown = 1;
+	if (min_elements > newer_elements) {
+		while (newer_elements < min_elements) {
+			newer_elements *= 2;
+		}
+		inc_size = _no_inc;
+	}
+	else if (!all_bigger) {
+		if (ht->active_count < (ht->n_elements/p->shrink_ratio)) {
 			inc_size = _desize;
 		}
-		else if (ht->active_count < (ht->n_elements/rehash_rat)) {
+		else if (ht->active_count < (ht->n_elements/p->rehash_ratio)) {
 			inc_size = _no_inc;
 		}
 	}
-	for (;;) {
-		new_salt = avalanche64(new_salt, 0);
+	for (int tries = 0; tries < max_resize_tries; tries++) {
 		if (inc_size == _desize) {
-			newer_elements /= 2;
+			if (newer_elements > 8) {
+				newer_elements /= 2;
+			}
 			inc_size = _no_inc;
 		}
 		else if (inc_size != _no_inc) {
-			newer_elements *= 2;
+			size_t by = p->growth < max_grow / grown ? p->growth : max_grow / grown;
+			newer_elements *= by;
+			grown *= by;
 		}
 		else {
 			inc_size = _inc_size;
 		}
-		ntbl = create_ht(newer_elements, ht->n_hazards);
-		ntbl->salt = new_salt;
-		ntbl->active_count = ht->active_count;
-		item *celem = ht->active_l;
-		int crs = 0;
-		while (celem) {
-			if (has_elem(celem->key)) {
-				uint64_t rkey = celem->key;
-				int useless;
-				item *item_at = insert_into(ntbl->elems,
-											newer_elements,
-											new_salt,
-											rkey,
-											NULL,
-											NULL);
-				if (!item_at) {
-					goto retry;
-				}
+		ntbl = rehash_into(sht, ht, newer_elements, new_salt(), pending, 0, 0);
+		if (ntbl) {
+			return ntbl;
+		}
+	}
+	return 0;
+}
 
-				//this can't be equal to exists!
-				//uniqueness is already know at here!
+//splits ht on its next hash bit into two segments of half its size,
+//so until ht is retired the split holds one segment more than the
+//table needs. The halves start at ht's load, and grow on their own
+static char split_into(const shared_hash_table *sht,
+					   const hash_table *ht,
+					   uint64_t pending,
+					   hash_table **lo,
+					   hash_table **hi) {
+	uint64_t mask = (uint64_t)1 << (63 - ht->depth);
+	uint64_t lo_pending = (pending & mask) ? 0 : pending;
+	uint64_t hi_pending = (pending & mask) ? pending : 0;
+	*lo = *hi = 0;
+	for (int tries = 0; !*lo && tries < max_resize_tries; tries++) {
+		*lo = rehash_into(sht, ht, ht->n_elements / 2, new_salt(), lo_pending, mask, 0);
+	}
+	for (int tries = 0; *lo && !*hi && tries < max_resize_tries; tries++) {
+		*hi = rehash_into(sht, ht, ht->n_elements / 2, new_salt(), hi_pending, mask, mask);
+	}
+	if (!*hi) {
+		if (*lo) {
+			free_htable(*lo);
+		}
+		return 0;
+	}
+	return 1;
+}
 
-				item_at->key = celem->key;
-				item_at->data = celem->data;
-				item_at->keyp = celem->keyp;
-				item_at->iter_next = ntbl->active_l;
-				ntbl->active_l = item_at;
+//the auto-tuner, run when ht has run out of room. Running out well
+//under the target load means the probes gave up before the slots did,
+//so segments get more of them. Over it, the probes readers pay for
+//are weighed instead. Needing a resize after few new items at the
+//target load means segments should grow more at a time - under it
+//the probes or the stash ran out, which growing doesn't help with,
+//as with colliding keys. Takes effect as segments are rehashed
+static void tune_policy(shared_hash_table *sht, const hash_table *ht) {
+	struct table_policy *p = &sht->policy;
+	uint64_t lookups = 0, probes = 0;
+	for (size_t i = 0; i < sht->nhazards; i++) {
+		lookups += atomic_load(sht->hazard_refs[i].lookups, mem_relaxed);
+		probes += atomic_load(sht->hazard_refs[i].probes, mem_relaxed);
+	}
+	uint64_t dlookups = lookups - sht->tuned_lookups;
+	uint64_t dprobes = probes - sht->tuned_probes;
+	sht->tuned_lookups = lookups;
+	sht->tuned_probes = probes;
+
+	size_t load = 100 * ht->active_count / ht->n_elements;
+	size_t added = ht->active_count + ht->dead_count - ht->start_live;
+	if (load < p->target_load / 2) {
+		if (p->probes < max_probes) {
+			p->probes++;
+		}
+	}
+	//an average past two probes means lookups mostly miss or go deep
+	else if (load > p->target_load && dlookups && dprobes > 2 * dlookups) {
+		if (p->probes > 1) {
+			p->probes--;
+		}
+	}
+	if (load >= p->target_load) {
+		if (added < ht->start_live / 4) {
+			if (p->growth < max_growth) {
+				p->growth *= 2;
 			}
-			celem = celem->iter_next;
 		}
-		break;
-		retry:
-		free_htable(ntbl);
+		else if (p->growth > 2) {
+			p->growth /= 2;
+		}
 	}
-	return ntbl;
 }
 
-void _insert(shared_hash_table *sht, const void *key, void *data) {
+//replaces a segment that has run out of room. big segments are
+//split, anything else is rehashed like a whole table used to be.
+//hi is left 0 unless the segment was split
+static char grow_segment(shared_hash_table *sht,
+						 const hash_table *ht,
+						 uint64_t pending,
+						 hash_table **lo,
+						 hash_table **hi) {
+	if (sht->policy.auto_tune) {
+		tune_policy(sht, ht);
+	}
+	//a rehash is what clears out tombstones,
+	//a split only helps a segment that's full of live items
+	if (ht->n_elements >= sht->policy.seg_elems
+		&& ht->depth < max_dir_depth
+		&& ht->dead_count < ht->active_count) {
+		if (!split_into(sht, ht, pending, lo, hi)) {
+			return 0;
+		}
+	}
+	else {
+		*hi = 0;
+		*lo = resize_into(sht, ht, pending, 0, 0);
+		if (!*lo) {
+			return 0;
+		}
+	}
+	sht->resizes++;
+	return 1;
+}
+
+/****
+* tracing
+*/
+
+//each thread records into a buffer of its own, which is kept with the
+//trace for as long as the table lives, so recording never has to
+//wait on anything but a full buffer being written out
+typedef struct trace_buf {
+	struct trace_buf *next;
+	pthread_t owner;
+	uint32_t stream;
+	char busy; //set while the owner records, the stopper waits it out
+	size_t n;
+	struct trace_rec recs[trace_buf_recs];
+} trace_buf;
+
+typedef struct trace {
+	pthread_mutex_t ctl; //starting and stopping, and the list of buffers
+	pthread_mutex_t out_lock;
+	FILE *out;
+	uint64_t start;
+	uint32_t nstreams;
+	trace_buf *bufs;
+	char on;
+} trace;
+
+static thread_l trace *my_trace;
+static thread_l trace_buf *my_trace_buf;
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void flush_trace_buf(trace *tr, trace_buf *b) {
+	struct trace_chunk c = {b->stream, (uint32_t)b->n};
+	pthread_mutex_lock(&tr->out_lock);
+	if (tr->out && b->n) {
+		fwrite(&c, sizeof(c), 1, tr->out);
+		fwrite(b->recs, sizeof(struct trace_rec), b->n, tr->out);
+	}
+	pthread_mutex_unlock(&tr->out_lock);
+	b->n = 0;
+}
+
+static trace_buf *find_trace_buf(trace *tr) {
+	pthread_t self = pthread_self();
+	pthread_mutex_lock(&tr->ctl);
+	trace_buf *b = tr->bufs;
+	while (b && !pthread_equal(b->owner, self)) {
+		b = b->next;
+	}
+	if (!b && (b = malloc(sizeof(trace_buf)))) {
+		b->owner = self;
+		b->stream = tr->nstreams++;
+		b->busy = 0;
+		b->n = 0;
+		b->next = tr->bufs;
+		tr->bufs = b;
+	}
+	pthread_mutex_unlock(&tr->ctl);
+	if (b) {
+		my_trace = tr;
+		my_trace_buf = b;
+	}
+	return b;
+}
+
+static void trace_op(shared_hash_table *sht, enum trace_op op, const void *key) {
+	trace *tr = sht->trace;
+	if (!tr || !atomic_load(tr->on, mem_relaxed)) {
+		return;
+	}
+	trace_buf *b = my_trace == tr ? my_trace_buf : find_trace_buf(tr);
+	if (!b) {
+		return;
+	}
+	//pairs with the barrier in stop_trace - either it sees busy,
+	//or this sees the trace is off
+	atomic_store(b->busy, 1, mem_relaxed);
+	atomic_barrier(mem_seq_cst);
+	if (atomic_load(tr->on, mem_relaxed)) {
+		struct trace_rec *r = &b->recs[b->n];
+		r->keyh = op == trace_for_each ? 0 : sht->hashfn(key);
+		r->when = ((uint64_t)op << trace_when_bits) | (now_ns() - tr->start);
+		if (++b->n == trace_buf_recs) {
+			flush_trace_buf(tr, b);
+		}
+	}
+	atomic_store(b->busy, 0, mem_release);
+}
+
+char start_trace(shared_hash_table *sht, const char *path) {
+	//the trace lives in this process, readers elsewhere couldn't use it
+	if (sht->region) {
+		return 0;
+	}
+	while (!acquire_write(sht)) {}
+	if (!sht->trace) {
+		trace *tr = calloc(1, sizeof(trace));
+		if (tr) {
+			pthread_mutex_init(&tr->ctl, NULL);
+			pthread_mutex_init(&tr->out_lock, NULL);
+			atomic_store(sht->trace, tr, mem_release);
+		}
+	}
+	release_write(sht);
+	trace *tr = sht->trace;
+	if (!tr) {
+		return 0;
+	}
+	pthread_mutex_lock(&tr->ctl);
+	if (tr->on) {
+		pthread_mutex_unlock(&tr->ctl);
+		return 0;
+	}
+	FILE *out = fopen(path, "wb");
+	struct trace_header h = {trace_magic, trace_version};
+	if (!out || fwrite(&h, sizeof(h), 1, out) != 1) {
+		if (out) {
+			fclose(out);
+		}
+		pthread_mutex_unlock(&tr->ctl);
+		return 0;
+	}
+	//nothing records while it's off, so the buffers are ours
+	for (trace_buf *b = tr->bufs; b; b = b->next) {
+		b->n = 0;
+	}
+	tr->out = out;
+	tr->start = now_ns();
+	atomic_store(tr->on, 1, mem_release);
+	pthread_mutex_unlock(&tr->ctl);
+	return 1;
+}
+
+char stop_trace(shared_hash_table *sht) {
+	trace *tr = sht->trace;
+	if (!tr) {
+		return 0;
+	}
+	pthread_mutex_lock(&tr->ctl);
+	if (!tr->on) {
+		pthread_mutex_unlock(&tr->ctl);
+		return 0;
+	}
+	atomic_store(tr->on, 0, mem_relaxed);
+	atomic_barrier(mem_seq_cst);
+	for (trace_buf *b = tr->bufs; b; b = b->next) {
+		while (atomic_load(b->busy, mem_acquire)) {}
+		flush_trace_buf(tr, b);
+	}
+	pthread_mutex_lock(&tr->out_lock);
+	char ok = fclose(tr->out) == 0;
+	tr->out = 0;
+	pthread_mutex_unlock(&tr->out_lock);
+	pthread_mutex_unlock(&tr->ctl);
+	return ok;
+}
+
+size_t get_resize_count(shared_hash_table *sht) {
+	return atomic_load(sht->resizes, mem_relaxed);
+}
+
+size_t get_parallel_rehash_count(shared_hash_table *sht) {
+	while (!acquire_write(sht)) {}
+	size_t runs = sht->pool ? sht->pool->runs : 0;
+	release_write(sht);
+	return runs;
+}
+
+/****
+* hot key cache
+*/
+
+//a hit is only trusted if the generation hasn't moved since,
+//so the slot still holds the key and its segment is still live
+typedef struct hot_entry {
+	const shared_hash_table *sht;
+	const void *key;
+	item *slot;
+	hash_table *seg;
+	uint64_t gen;
+} hot_entry;
+
+static thread_l hot_entry hot_cache[1 << hot_cache_bits];
+
+//keys are looked up by pointer, which for integer keys is the key
+static inline hot_entry *hot_slot(const void *key) {
+	uint64_t k = (uint64_t)key * 0x9e3779b97f4a7c15ULL;
+	return &hot_cache[k >> (64 - hot_cache_bits)];
+}
+
+//stays even, so it can't line up with an update in progress
+static inline void drop_hot(shared_hash_table *sht) {
+	if (sht->hot_cache) {
+		atomic_fetch_add(sht->generation, 2, mem_release);
+	}
+}
+
+/****
+* multiple writers
+*/
+
+static inline count_shard *my_counts(hash_table *ht) {
+	return &ht->counts[thread_shard()];
+}
+
+//adds what shared writers counted and removed to the segment's own.
+//needs the table to itself. Their active lists stay where they are,
+//since shared_table_for_each may be walking them - moving one onto
+//the segment's list could take a reader through it twice
+static void fold_counts(hash_table *ht) {
+	for (size_t i = 0; i < count_shards; i++) {
+		count_shard *c = &ht->counts[i];
+		ht->active_count += c->live;
+		ht->dead_count += c->dead;
+		c->live = c->dead = 0;
+		if (c->cleanup) {
+			item *tail = c->cleanup;
+			while (tail->next) {
+				tail = tail->next;
+			}
+			tail->next = ht->cleanup_with_me;
+			ht->cleanup_with_me = c->cleanup;
+			c->cleanup = 0;
+		}
+	}
+}
+
+static size_t count_live(hash_dir *d) {
+	size_t total = 0;
+	for (size_t i = 0; i < dir_entries(d); i += seg_run(d, i)) {
+		fold_counts(d->segs[i]);
+		total += d->segs[i]->active_count;
+	}
+	return total;
+}
+
+//claims a slot for key by a cas from empty to busy, or returns _exists.
+//every writer tries the slots in the same order and they never
+//go back to empty, so two writers of one key meet at the first slot
+//either of them claims, and the loser finds the key there
+static item *claim_insert(hash_table *ht,
+						  uint64_t keyh,
+						  const void *key,
+						  compfn_type cmp) {
+	uint64_t lkey = keyh;
+	for (size_t i = 0; i < ht->probes + stash_size; i++) {
+		item *item_at;
+		if (i < ht->probes) {
+			lkey = avalanche64(lkey, ht->salt);
+			item_at = &ht->elems[lkey & (ht->n_elements - 1)];
+		}
+		else {
+			item_at = &ht->stash[i - ht->probes];
+		}
+		uint64_t cur = atomic_load(item_at->key, mem_acquire);
+		if (test_empty(cur)
+			&& atomic_cas(item_at->key, cur, is_busy, mem_acquire, mem_acquire)) {
+			return item_at;
+		}
+		while (cur == is_busy) {
+			cur = atomic_load(item_at->key, mem_acquire);
+		}
+		if (cur == keyh && cmp(item_at->keyp, key)) {
+			return _exists;
+		}
+	}
+	return 0;
+}
+
+//inserts without the table to itself. returns -1 when the key needs
+//the exclusive path, because the segment is full or a mode is on
+//which only a single writer can keep up
+static int shared_insert(shared_hash_table *sht, const void *key, void *data) {
+	while (!acquire_shared(sht)) {}
+	int rval = -1;
+	if (sht->cache_on || sht->feed || sht->defer_head) {
+		goto done;
+	}
 	uint64_t keyh = sht->hashfn(key);
-	item *add_to;
-	hash_table *ht = sht->current_table;
-	int ins_res;
-	int all_bigger = 0;
-	while (!(add_to = insert_into(ht->elems, ht->n_elements, ht->salt,
-							      keyh, key, sht->compfn))) {
-		hash_table *nht = resize_into(ht, ins_res, all_bigger);
-		if (ht != sht->current_table) {
-			free_htable(ht);
-		}
-		all_bigger = 1;
-		ht = nht;
+	hash_dir *d = sht->current_dir;
+	hash_table *ht = d->segs[seg_index(d, keyh)];
+	if (ht->keylen) {
+		goto done;
+	}
+	item *add_to = claim_insert(ht, keyh, key, sht->compfn);
+	if (!add_to) {
+		goto done;
 	}
+	rval = 1;
 	if (add_to == _exists) {
-		return;
+		goto done;
+	}
+	add_to->data = data;
+	add_to->keyp = key;
+	atomic_store(add_to->key, keyh, mem_release);
+
+	count_shard *c = my_counts(ht);
+	item *head = atomic_load(c->active_l, mem_relaxed);
+	do {
+		add_to->iter_next = head;
+	} while (!atomic_cas(c->active_l, head, add_to, mem_release));
+
+	if (add_to >= ht->stash) {
+		size_t want = add_to - ht->stash + 1;
+		size_t cur = atomic_load(ht->stash_count, mem_relaxed);
+		while (cur < want
+			   && !atomic_cas(ht->stash_count, cur, want, mem_release)) {}
+	}
+	atomic_fetch_add(c->live, 1, mem_relaxed);
+done:
+	release_shared(sht);
+	return rval;
+}
+
+//the cas on the key decides which of two removers gets the value
+static int shared_remove(shared_hash_table *sht, const void *key, void **rval) {
+	while (!acquire_shared(sht)) {}
+	*rval = 0;
+	if (sht->cache_on || sht->feed || sht->defer_head) {
+		release_shared(sht);
+		return 0;
 	}
-	if (ht != sht->current_table) {
-		update_table(sht, ht);
+	uint64_t keyh = sht->hashfn(key);
+	hash_dir *d = sht->current_dir;
+	hash_table *ht = d->segs[seg_index(d, keyh)];
+	item *add_to = lookup_exist(ht, keyh, key, sht->compfn);
+	uint64_t cur = keyh;
+	if (add_to && atomic_cas(add_to->key, cur, is_del, mem_acquire)) {
+		count_shard *c = my_counts(ht);
+		item *head = atomic_load(c->cleanup, mem_relaxed);
+		do {
+			add_to->next = head;
+		} while (!atomic_cas(c->cleanup, head, add_to, mem_relaxed));
+		atomic_fetch_sub(c->live, 1, mem_relaxed);
+		atomic_fetch_add(c->dead, 1, mem_relaxed);
+		drop_hot(sht);
+		*rval = add_to->data;
+	}
+	release_shared(sht);
+	return 1;
+}
+
+/****
+* cache mode
+*/
+
+static uint32_t cache_now(shared_hash_table *sht) {
+	return (uint32_t)(now_secs() - sht->epoch) + 1;
+}
+
+static void evict_item(shared_hash_table *sht, hash_table *ht, item *it) {
+	ht->active_count -= 1;
+	ht->dead_count += 1;
+	sht->n_active -= 1;
+	//same as a removal, but the value is the table's to free
+	//once ht is retired and no reader can see it
+	it->key = is_del;
+	meta_of(ht, it)->evicted = 1;
+	it->next = ht->cleanup_with_me;
+	ht->cleanup_with_me = it;
+	drop_hot(sht);
+	log_change(sht, remove_item, it->keyp, it->data);
+}
+
+//CLOCK over the slots: moves the hand over at least nslots,
+//and for as long as the table is over its limit.
+//expired items are always evicted, others only if unreferenced
+static void sweep_cache(shared_hash_table *sht, size_t nslots) {
+	hash_dir *d = sht->current_dir;
+	size_t nents = dir_entries(d);
+	uint32_t now = cache_now(sht);
+	int laps = 0;
+	if (sht->hand_idx >= nents) {
+		sht->hand_idx = 0;
+	}
+	//twice around clears every reference bit, so that's the most needed
+	for (size_t i = 0; laps < 2; i++) {
+		char over = sht->cache_max && sht->n_active >= sht->cache_max;
+		if (i >= nslots && !over) {
+			break;
+		}
+		hash_table *ht = d->segs[sht->hand_idx];
+		//elems and the stash are contiguous
+		item *it = &ht->elems[ht->hand];
+		if (++ht->hand == ht->n_elements + stash_size) {
+			//on to the segment after this one's run of entries
+			ht->hand = 0;
+			sht->hand_idx = seg_start(d, sht->hand_idx) + seg_run(d, sht->hand_idx);
+			if (sht->hand_idx == nents) {
+				sht->hand_idx = 0;
+				laps++;
+			}
+		}
+		if (!has_elem(it->key)) {
+			continue;
+		}
+		slot_meta *sm = meta_of(ht, it);
+		if (sm->expires && sm->expires <= now) {
+			evict_item(sht, ht, it);
+		}
+		else if (!over) {
+			continue;
+		}
+		else if (sm->ref) {
+			atomic_store(sm->ref, 0, mem_relaxed);
+		}
+		else {
+			evict_item(sht, ht, it);
+		}
+	}
+	publish_changes(sht);
+}
+
+//gives every segment its slot_meta before turning cache mode on,
+//segments rehashed from then on are made with one
+static char enable_cache(shared_hash_table *sht) {
+	hash_dir *d = sht->current_dir;
+	for (size_t i = 0; i < dir_entries(d); i += seg_run(d, i)) {
+		if (!d->segs[i]->meta && !add_meta(d->segs[i])) {
+			return 0;
+		}
+	}
+	atomic_store(sht->cache_on, 1, mem_relaxed);
+	return 1;
+}
+
+char set_cache_limit(shared_hash_table *sht,
+					 size_t max_entries,
+					 delfn_type evictfn,
+					 void *params) {
+	while (!acquire_write(sht)) {}
+	char ok = sht->cache_on || enable_cache(sht);
+	if (ok) {
+		sht->n_active = count_live(sht->current_dir);
+		sht->cache_max = max_entries;
+		sht->evictfn = evictfn;
+		sht->evict_params = params;
+	}
+	release_write(sht);
+	return ok;
+}
+
+void set_retired_limit(shared_hash_table *sht,
+					   size_t max_bytes,
+					   retirefn_type retirefn,
+					   void *params) {
+	while (!acquire_write(sht)) {}
+	sht->retired_max = max_bytes;
+	sht->retirefn = retirefn;
+	sht->retire_params = params;
+	release_write(sht);
+}
+
+size_t retired_bytes(shared_hash_table *sht) {
+	while (!acquire_write(sht)) {}
+	size_t rval = sht->retired_bytes;
+	release_write(sht);
+	return rval;
+}
+
+long stalled_reader(shared_hash_table *sht, uint64_t *secs) {
+	while (!acquire_write(sht)) {}
+	long id = stalled_id(sht, secs);
+	release_write(sht);
+	return id;
+}
+
+void set_table_policy(shared_hash_table *sht, const struct table_policy *p) {
+	while (!acquire_write(sht)) {}
+	clamp_policy(&sht->policy, p);
+	release_write(sht);
+}
+
+void get_table_policy(shared_hash_table *sht, struct table_policy *p) {
+	while (!acquire_write(sht)) {}
+	*p = sht->policy;
+	release_write(sht);
+}
+
+void set_hot_cache(shared_hash_table *sht, char on) {
+	while (!acquire_write(sht)) {}
+	//entries from before it was turned off missed removals since
+	atomic_fetch_add(sht->generation, 2, mem_release);
+	atomic_store(sht->hot_cache, on, mem_relaxed);
+	release_write(sht);
+}
+
+char set_rehash_threads(shared_hash_table *sht, size_t nthreads) {
+	if (nthreads > max_rehash_threads) {
+		nthreads = max_rehash_threads;
+	}
+	rehash_pool *pool = nthreads > 1 ? start_pool(nthreads - 1) : 0;
+	while (!acquire_write(sht)) {}
+	rehash_pool *old = sht->pool;
+	if (old && pool) {
+		pool->runs = old->runs;
+	}
+	sht->pool = pool;
+	release_write(sht);
+	//nothing can be rehashing with the old pool anymore
+	if (old) {
+		stop_pool(old);
+	}
+	return nthreads <= 1 || pool;
+}
+
+char set_key_copying(shared_hash_table *sht, keylenfn_type keylen) {
+	while (!acquire_write(sht)) {}
+	char ok = !sht->feed && count_live(sht->current_dir) == 0;
+	if (ok) {
+		hash_dir *d = sht->current_dir;
+		for (size_t i = 0; i < dir_entries(d); i += seg_run(d, i)) {
+			d->segs[i]->keylen = keylen;
+		}
+	}
+	release_write(sht);
+	return ok;
+}
+
+void set_multi_writer(shared_hash_table *sht, char on) {
+	while (!acquire_write(sht)) {}
+	atomic_store(sht->multi_writer, on, mem_relaxed);
+	release_write(sht);
+}
+
+void cache_sweep(shared_hash_table *sht, size_t nslots) {
+	while (!acquire_write(sht)) {}
+	if (sht->cache_on) {
+		sweep_cache(sht, nslots);
+	}
+	release_write(sht);
+}
+
+//returns 0 if the key couldn't be placed without
+//growing the table past the limits above, or insert_deferred
+//if growing would go over the retired memory limit
+static char place_key(shared_hash_table *sht, const void *key, void *data, uint32_t expires) {
+	uint64_t keyh = sht->hashfn(key);
+	if (sht->cache_on) {
+		sweep_cache(sht, sweep_step);
+	}
+	hash_dir *d = sht->current_dir;
+	size_t idx = seg_index(d, keyh);
+	hash_table *ht = d->segs[idx];
+	item *add_to = insert_into(ht, keyh, key, sht->compfn);
+	if (!add_to) {
+		hash_table *lo, *hi;
+		room_action act = retire_room(sht, seg_bytes(ht) + dir_bytes(sht, d));
+		if (act != room_ok) {
+			return act == room_defer ? insert_deferred : 0;
+		}
+		fold_counts(ht);
+		if (!grow_segment(sht, ht, keyh, &lo, &hi)) {
+			return 0;
+		}
+		hash_dir *nd;
+		if (hi) {
+			nd = dir_with_split(sht, d, idx, lo, hi);
+		}
+		else {
+			nd = copy_dir(sht, d);
+			if (nd) {
+				dir_set_run(nd, idx, lo);
+			}
+		}
+		if (!nd) {
+			free_htable(lo);
+			if (hi) {
+				free_htable(hi);
+			}
+			return 0;
+		}
+		ht->next = 0;
+		update_table(sht, nd, ht);
+		//the grown segment was made with room for this key
+		ht = nd->segs[seg_index(nd, keyh)];
+		add_to = insert_into(ht, keyh, key, NULL);
+	}
+	if (add_to == _exists) {
+		return 1;
+	}
+	if (ht->keylen) {
+		key = copy_key(ht, &ht->keys, key);
+		if (!key) {
+			return 0;
+		}
 	}
 	add_to->data = data;
 	add_to->keyp = key;
+	if (ht->meta) {
+		meta_of(ht, add_to)->expires = expires;
+	}
 	atomic_store(add_to->key, keyh, mem_release);
 	add_to->iter_next = ht->active_l;
 
 	atomic_store(ht->active_l, add_to, mem_release);
+	commit_slot(ht, add_to);
 	ht->active_count += 1;
+	sht->n_active += 1;
+	log_change(sht, add_item, key, data);
+	publish_changes(sht);
+	return 1;
+}
+
+static char defer_key(shared_hash_table *sht, const void *key, void *data, uint32_t expires) {
+	message *m = malloc(sizeof(message));
+	if (!m) {
+		return 0;
+	}
+	m->key = key;
+	m->data = data;
+	m->timestamp = expires;
+	m->mtype = add_item;
+	m->next = 0;
+	if (sht->defer_tail) {
+		sht->defer_tail->next = m;
+	}
+	else {
+		sht->defer_head = m;
+	}
+	sht->defer_tail = m;
+	return 1;
+}
+
+//places deferred inserts in order until one has to wait again.
+//one rejected by the growth bounds is handed to evictfn, if set,
+//since whoever inserted it was told it went in
+static void drain_deferred(shared_hash_table *sht) {
+	message *m;
+	while ((m = sht->defer_head)) {
+		char r = place_key(sht, m->key, m->data, m->timestamp);
+		if (r == insert_deferred) {
+			return;
+		}
+		if (!r && sht->evictfn) {
+			sht->evictfn(m->key, m->data, sht->evict_params);
+		}
+		sht->defer_head = m->next;
+		if (!sht->defer_head) {
+			sht->defer_tail = 0;
+		}
+		free(m);
+	}
+}
+
+//once anything is deferred, later inserts queue up behind it,
+//so an insert of a key never overtakes an earlier one
+char _insert(shared_hash_table *sht, const void *key, void *data, uint32_t expires) {
+	if (sht->defer_head) {
+		drain_deferred(sht);
+		if (sht->defer_head) {
+			return defer_key(sht, key, data, expires) ? insert_deferred : 0;
+		}
+	}
+	char r = place_key(sht, key, data, expires);
+	if (r == insert_deferred) {
+		return defer_key(sht, key, data, expires) ? insert_deferred : 0;
+	}
+	return r;
+}
+
+//freeing retired memory may make room for deferred inserts,
+//so they're placed here too
+void try_clean_mem(shared_hash_table *sh) {
+	while (!acquire_write(sh)) {}
+	clear_tables(sh);
+	if (sh->defer_head) {
+		drain_deferred(sh);
+	}
+	release_write(sh);
+}
+
+void clean_all_mem(shared_hash_table *sh) {
+	while (!acquire_write(sh)) {}
+	while (sh->old_dirs || sh->defer_head) {
+		clear_tables(sh);
+		if (sh->defer_head) {
+			drain_deferred(sh);
+		}
+	}
+	release_write(sh);
+}
+
+//drops the deferred inserts of key. if the table didn't have it,
+//the first of them is the one a lookup would have found
+static void *remove_deferred(shared_hash_table *sht, const void *key, char found) {
+	void *rval = 0;
+	message **at = &sht->defer_head;
+	sht->defer_tail = 0;
+	while (*at) {
+		message *m = *at;
+		if (sht->compfn(m->key, key)) {
+			if (!found) {
+				rval = m->data;
+				found = 1;
+			}
+			*at = m->next;
+			free(m);
+		}
+		else {
+			sht->defer_tail = m;
+			at = &m->next;
+		}
+	}
+	return rval;
 }
 
 void *_remove_element(struct shared_hash_table *sht, const void *key) {
-	hash_table *ht = sht->current_table;
 	uint64_t keyh = sht->hashfn(key);
-	item *add_to = lookup_exist(ht->elems, ht->n_elements, ht->salt,
-								keyh, key, sht->compfn);
+	hash_dir *d = sht->current_dir;
+	hash_table *ht = d->segs[seg_index(d, keyh)];
+	item *add_to = lookup_exist(ht, keyh, key, sht->compfn);
+	if (sht->defer_head) {
+		void *rval = remove_deferred(sht, key, add_to != 0);
+		if (!add_to) {
+			return rval;
+		}
+	}
 	if (add_to) {
 		ht->active_count -= 1;
+		ht->dead_count += 1;
+		sht->n_active -= 1;
 		//no synchronization here,
 		//doesn't matter if someone is looking/looks this up
 		add_to->key = is_del;
 		add_to->next = ht->cleanup_with_me;
 		ht->cleanup_with_me = add_to;
+		drop_hot(sht);
+		//the table's key, the caller's may not outlive this call
+		log_change(sht, remove_item, add_to->keyp, add_to->data);
+		publish_changes(sht);
 		return add_to->data;
 	}
 	return 0;
 }
 
-char apply_to_elem(struct shared_hash_table *sht,
-   				   size_t id,
-			       const void *key,
-			       void (*appfn)(const void *, void *, void *),
-			       void *params) {
-	uint64_t keyh = sht->hashfn(key);
-	hash_table *ht = acquire_table(sht, id);
-	item *add_to = lookup_exist(ht->elems, ht->n_elements, ht->salt,
-							    keyh, key, sht->compfn);
+static char lookup_apply(shared_hash_table *sht,
+						 hashfn_type hashfn,
+						 compfn_type compfn,
+						 size_t id,
+						 const void *key,
+						 void (*appfn)(const void *, void *, void *),
+						 void *params) {
+	item *add_to = 0;
+	hash_table *ht = 0;
+	hot_entry *hot = 0;
+	uint64_t gen = 0;
+	hash_dir *d;
+	if (sht->hot_cache) {
+		//the generation has to be read before the directory, so an
+		//entry filled from an old directory is already out of date
+		atomic_fetch_add(sht->hazard_refs[id].nactive, 1, mem_acquire);
+		gen = atomic_load(sht->generation, mem_acquire);
+		d = atomic_load(sht->current_dir, mem_acquire);
+		hot = hot_slot(key);
+		//the same key pointer in the slot is the same key,
+		//or the table would be broken already
+		if (hot->sht == sht && hot->gen == gen && hot->key == key
+			&& (hot->slot->keyp == key || compfn(hot->slot->keyp, key))) {
+			add_to = hot->slot;
+			ht = hot->seg;
+		}
+	}
+	else {
+		d = acquire_table(sht, id);
+	}
+	if (!add_to) {
+		uint64_t keyh = hashfn(key);
+		ht = d->segs[seg_index(d, keyh)];
+		size_t nprobes;
+		add_to = lookup_probes(ht, keyh, key, compfn, &nprobes);
+		if (sht->policy.auto_tune) {
+			hz_st *hz = &sht->hazard_refs[id];
+			atomic_fetch_add(hz->lookups, 1, mem_relaxed);
+			atomic_fetch_add(hz->probes, nprobes, mem_relaxed);
+		}
+		if (add_to && hot && !(gen & 1)) {
+			hot->sht = sht;
+			hot->key = key;
+			hot->slot = add_to;
+			hot->seg = ht;
+			hot->gen = gen;
+		}
+	}
 	if (add_to) {
 		atomic_barrier(mem_acquire);
+		//plain store, and only when it changes anything,
+		//so hot items don't keep bouncing their cache line.
+		//segments from before cache mode have no meta
+		slot_meta *meta;
+		if (sht->cache_on && (meta = atomic_load(ht->meta, mem_acquire))) {
+			slot_meta *sm = &meta[add_to - ht->elems];
+			if (!sm->ref) {
+				atomic_store(sm->ref, 1, mem_relaxed);
+			}
+		}
 		appfn(add_to->keyp, add_to->data, params);
 		release_table(sht, id);
 		return 1;
@@ -619,34 +2821,70 @@ char apply_to_elem(struct shared_hash_table *sht,
 	return 0;
 }
 
+char apply_to_elem(struct shared_hash_table *sht,
+   				   size_t id,
+			       const void *key,
+			       void (*appfn)(const void *, void *, void *),
+			       void *params) {
+	if (sht->trace) {
+		trace_op(sht, trace_lookup, key);
+	}
+	return lookup_apply(sht, sht->hashfn, sht->compfn, id, key, appfn, params);
+}
+
+char shm_apply_to_elem(shm_handle *h,
+					   size_t id,
+					   const void *key,
+					   void (*appfn)(const void *, void *, void *),
+					   void *params) {
+	return lookup_apply(h->sht, h->hashfn, h->compfn, id, key, appfn, params);
+}
+
 void shared_table_for_each(shared_hash_table *sht,
 						   size_t id,
 						   char (*appfnc)(const void*, const void *, void *),
 						   void *params) {
-	hash_table *ctbl = acquire_table(sht, id);
-
-	item *citem = ctbl->active_l;
-	while (citem) {
-		consume_barrier;
-		if (has_elem(citem->key)) {
-			//need an acquire barrier here since we are synchronizing
-			//with stores to key, not just loads of citem
-			atomic_barrier(mem_acquire);
-			if (!appfnc(citem->keyp, citem->data, params)) {
-				break;
+	if (sht->trace) {
+		trace_op(sht, trace_for_each, 0);
+	}
+	hash_dir *d = acquire_table(sht, id);
+	size_t nents = dir_entries(d);
+
+	//every segment once, skipping the rest of its run
+	for (size_t i = 0; i < nents; i += seg_run(d, i)) {
+		for (size_t l = 0; l < active_lists; l++) {
+			item *citem = active_list(d->segs[i], l);
+			while (citem) {
+				consume_barrier;
+				if (has_elem(citem->key)) {
+					//need an acquire barrier here since we are synchronizing
+					//with stores to key, not just loads of citem
+					atomic_barrier(mem_acquire);
+					if (!appfnc(citem->keyp, citem->data, params)) {
+						goto done;
+					}
+				}
+				citem = citem->iter_next;
 			}
 		}
-		citem = citem->iter_next;
 	}
+	done:
 	release_table(sht, id);
 }
 
+void shm_table_for_each(shm_handle *h,
+						size_t id,
+						char (*appfnc)(const void*, const void *, void *),
+						void *params) {
+	shared_table_for_each(h->sht, id, appfnc, params);
+}
+
 /****
 * message handling
 */
 
 static void insert_message(shared_hash_table *sht, message *m) {
-    _insert(sht, m->key, m->data);
+    _insert(sht, m->key, m->data, 0);
 }
 
 
@@ -679,20 +2917,381 @@ static void deal_with_messages(shared_hash_table *sht, int num_m) {
 }
 
 void *remove_element(shared_hash_table *sht, const void *key) {
+	void *rval;
+	if (sht->trace) {
+		trace_op(sht, trace_remove, key);
+	}
+	if (atomic_load(sht->multi_writer, mem_relaxed)
+		&& shared_remove(sht, key, &rval)) {
+		return rval;
+	}
 	while (!acquire_write(sht)) {} //simple for now
-	void *rval = _remove_element(sht, key);
+	rval = _remove_element(sht, key);
 	release_write(sht);
 	return rval;
 }
 
-void insert(shared_hash_table *sht, const void *key, void *data) {
+char insert(shared_hash_table *sht, const void *key, void *data) {
+	if (sht->trace) {
+		trace_op(sht, trace_insert, key);
+	}
+	if (atomic_load(sht->multi_writer, mem_relaxed)) {
+		int rval = shared_insert(sht, key, data);
+		if (rval >= 0) {
+			return rval;
+		}
+	}
 	while (!acquire_write(sht)) {} //simple for now
-	_insert(sht, key, data);
+	char rval = _insert(sht, key, data, 0);
+	release_write(sht);
+	return rval;
+}
+
+char insert_ttl(shared_hash_table *sht, const void *key, void *data, uint32_t ttl) {
+	if (sht->trace) {
+		trace_op(sht, trace_insert, key);
+	}
+	while (!acquire_write(sht)) {}
+	if (!sht->cache_on && !enable_cache(sht)) {
+		release_write(sht);
+		return 0;
+	}
+	char rval = _insert(sht, key, data, cache_now(sht) + ttl);
 	release_write(sht);
+	return rval;
 }
 
+/****
+* batches
+*/
+
+//a batch is applied to private copies of the segments it touches,
+//which are then published in a single directory with update_table,
+//so readers see either none or all of it
+
+typedef struct hash_batch {
+	message *head;
+	message *tail;
+	size_t n_adds;
+} hash_batch;
+
+hash_batch *create_batch() {
+	hash_batch *b = malloc(sizeof(*b));
+	if (b) {
+		b->head = b->tail = 0;
+		b->n_adds = 0;
+	}
+	return b;
+}
+
+static char batch_push(hash_batch *b, const void *key, void *data, message_type mtype) {
+	message *m = malloc(sizeof(*m));
+	if (!m) {
+		return 0;
+	}
+	m->key = key;
+	m->data = data;
+	m->next = 0;
+	m->fromwhich = 0;
+	m->timestamp = 0;
+	m->mtype = mtype;
+	if (b->tail) {
+		b->tail->next = m;
+	}
+	else {
+		b->head = m;
+	}
+	b->tail = m;
+	if (mtype != remove_item) {
+		b->n_adds++;
+	}
+	return 1;
+}
+
+char batch_insert(hash_batch *b, const void *key, void *data) {
+	return batch_push(b, key, data, add_item);
+}
+
+char batch_replace(hash_batch *b, const void *key, void *data) {
+	return batch_push(b, key, data, replace_item);
+}
+
+char batch_remove(hash_batch *b, const void *key) {
+	return batch_push(b, key, 0, remove_item);
+}
+
+static void clear_batch(hash_batch *b) {
+	message *m = b->head;
+	while (m) {
+		message *nxt = m->next;
+		free(m);
+		m = nxt;
+	}
+	b->head = b->tail = 0;
+	b->n_adds = 0;
+}
+
+void free_batch(hash_batch *b) {
+	clear_batch(b);
+	free(b);
+}
+
+//the directory and its segments are private here,
+//so no ordering is needed on any of the stores.
+//whatever m pushes out of the table is left in *pushed.
+//returns 0 if an insert couldn't be placed
+static char apply_batch_message(shared_hash_table *sht,
+								hash_dir **dp,
+								message *m,
+								void **pushed) {
+	hash_dir *d = *dp;
+	uint64_t keyh = m->keyh;
+	size_t idx = seg_index(d, keyh);
+	hash_table *ht = d->segs[idx];
+	item *at;
+	if (m->mtype == remove_item) {
+		at = lookup_exist(ht, keyh, m->key, sht->compfn);
+		*pushed = 0;
+		if (at) {
+			ht->active_count -= 1;
+			ht->dead_count += 1;
+			at->key = is_del;
+			at->next = ht->cleanup_with_me;
+			ht->cleanup_with_me = at;
+			*pushed = at->data;
+			log_change(sht, remove_item, at->keyp, at->data);
+		}
+		return 1;
+	}
+	at = insert_into(ht, keyh, m->key, sht->compfn);
+	if (!at) {
+		hash_table *lo, *hi;
+		fold_counts(ht);
+		if (!grow_segment(sht, ht, keyh, &lo, &hi)) {
+			return 0;
+		}
+		lo->priv = 1;
+		if (hi) {
+			hash_dir *nd = dir_with_split(sht, d, idx, lo, hi);
+			if (!nd) {
+				free_htable(lo);
+				free_htable(hi);
+				return 0;
+			}
+			hi->priv = 1;
+			free_mem(sht->region, d);
+			*dp = d = nd;
+		}
+		else {
+			dir_set_run(d, idx, lo);
+		}
+		free_htable(ht);
+		ht = d->segs[seg_index(d, keyh)];
+		at = insert_into(ht, keyh, m->key, NULL);
+	}
+	*pushed = m->data;
+	if (at == _exists) {
+		if (m->mtype == replace_item) {
+			at = lookup_exist(ht, keyh, m->key, sht->compfn);
+			*pushed = at->data;
+			at->data = m->data;
+			log_change(sht, add_item, at->keyp, at->data);
+		}
+		return 1;
+	}
+	const void *keyp = m->key;
+	if (ht->keylen) {
+		keyp = copy_key(ht, &ht->keys, m->key);
+		if (!keyp) {
+			return 0;
+		}
+	}
+	at->data = m->data;
+	at->keyp = keyp;
+	at->key = keyh;
+	at->iter_next = ht->active_l;
+	ht->active_l = at;
+	commit_slot(ht, at);
+	ht->active_count += 1;
+	log_change(sht, add_item, keyp, m->data);
+	*pushed = 0;
+	return 1;
+}
+
+//frees a batch's private copies and its directory, and puts back the
+//segments it was going to retire. The table is left as it was
+static void drop_batch(shared_hash_table *sht, hash_dir *d, hash_table *dead) {
+	for (size_t i = 0; i < dir_entries(d);) {
+		hash_table *seg = d->segs[i];
+		i += seg_run(d, i);
+		if (seg->priv) {
+			free_htable(seg);
+		}
+	}
+	free_mem(sht->region, d);
+	while (dead) {
+		hash_table *nxt = dead->next;
+		dead->next = 0;
+		dead = nxt;
+	}
+}
+
+char commit_batch(shared_hash_table *sht,
+				  hash_batch *b,
+				  delfn_type delfn,
+				  void *params) {
+	if (!b->head) {
+		return 1;
+	}
+	while (!acquire_write(sht)) {}
+	//deferred inserts came before the batch, so they go in first.
+	//if they still can't, neither can the batch
+	if (sht->defer_head) {
+		drain_deferred(sht);
+		if (sht->defer_head) {
+			release_write(sht);
+			return 0;
+		}
+	}
+	hash_dir *d = copy_dir(sht, sht->current_dir);
+	hash_table *dead = 0;
+	if (!d) {
+		release_write(sht);
+		return 0;
+	}
+
+	//adds going into each segment, counted at its first entry,
+	//so each copy is sized for them up front and the batch is one rehash
+	size_t *adds = calloc(dir_entries(d), sizeof(size_t));
+	size_t nmsgs = 0;
+	for (message *m = b->head; m; m = m->next) {
+		nmsgs++;
+	}
+	//what each message pushes out, only handed back once the batch is in
+	void **pushed = malloc(nmsgs * sizeof(void *));
+	if (!adds || !pushed) {
+		free(adds);
+		free(pushed);
+		free_mem(sht->region, d);
+		release_write(sht);
+		return 0;
+	}
+	for (message *m = b->head; m; m = m->next) {
+		m->keyh = sht->hashfn(m->key);
+		if (m->mtype != remove_item) {
+			adds[seg_start(d, seg_index(d, m->keyh))]++;
+		}
+	}
+
+	//copy every segment the batch touches before changing any,
+	//so running out of memory leaves nothing half applied.
+	//at the retired memory limit the batch is handed back the same way
+	size_t retiring = dir_bytes(sht, d);
+	for (message *m = b->head; m; m = m->next) {
+		size_t idx = seg_index(d, m->keyh);
+		hash_table *seg = d->segs[idx];
+		if (seg->priv) {
+			continue;
+		}
+		fold_counts(seg);
+		retiring += seg_bytes(seg);
+		hash_table *cp = 0;
+		size_t nadds = adds[seg_start(d, idx)];
+		size_t want = nadds ? (seg->active_count + nadds) * sht->policy.rehash_ratio : 0;
+		if (retire_room(sht, retiring) == room_ok) {
+			cp = resize_into(sht, seg, 0, want, 0);
+		}
+		if (!cp) {
+			free(adds);
+			free(pushed);
+			drop_batch(sht, d, dead);
+			release_write(sht);
+			return 0;
+		}
+		if (cp->n_elements > seg->n_elements) {
+			sht->resizes++;
+		}
+		cp->priv = 1;
+		dir_set_run(d, idx, cp);
+		seg->next = dead;
+		dead = seg;
+	}
+	free(adds);
+	//a key that can't be placed fails the whole batch. Everything it
+	//changed is private, and the records it logged aren't published yet
+	uint64_t feed_head = sht->feed ? sht->feed->head : 0;
+	char failed = 0;
+	size_t n = 0;
+	for (message *m = b->head; m && !failed; m = m->next, n++) {
+		failed = !apply_batch_message(sht, &d, m, &pushed[n]);
+	}
+	//copied keys are freed with their segment, which can be retired
+	//before the directory delfn runs from. So it gets copies made here,
+	//while the caller's keys are still good
+	keylenfn_type keylen = d->segs[0]->keylen;
+	char *pushed_keys = 0;
+	if (!failed && delfn && keylen) {
+		size_t kbytes = 0;
+		n = 0;
+		for (message *m = b->head; m; m = m->next, n++) {
+			if (pushed[n]) {
+				kbytes += (keylen(m->key) + 7) & ~(size_t)7;
+			}
+		}
+		failed = kbytes && !(pushed_keys = malloc(kbytes));
+	}
+	if (failed) {
+		if (sht->feed) {
+			sht->feed->head = feed_head;
+		}
+		free(pushed);
+		drop_batch(sht, d, dead);
+		release_write(sht);
+		return 0;
+	}
+	char *kat = pushed_keys;
+	n = 0;
+	for (message *m = b->head; m; m = m->next, n++) {
+		m->data = pushed[n];
+		if (pushed_keys && m->data) {
+			size_t len = keylen(m->key);
+			memcpy(kat, m->key, len);
+			m->key = kat;
+			kat += (len + 7) & ~(size_t)7;
+		}
+	}
+	free(pushed);
+	for (size_t i = 0; i < dir_entries(d); i += seg_run(d, i)) {
+		d->segs[i]->priv = 0;
+	}
+	sht->n_active = count_live(d);
+	//each message now holds whatever value it pushed out of the table.
+	//readers of the old directory may still be using them,
+	//so they go to delfn when it's retired
+	if (delfn) {
+		hash_dir *old = sht->current_dir;
+		old->pushed = b->head;
+		old->pushed_keys = pushed_keys;
+		old->delfn = delfn;
+		old->del_params = params;
+		b->head = b->tail = 0;
+	}
+	update_table(sht, d, dead);
+	//the batch's changes become visible to followers with the table
+	publish_changes(sht);
+	release_write(sht);
+	clear_batch(b);
+	return 1;
+}
+
+//slots over all the segments
 size_t get_size(shared_hash_table *sht) {
-	return sht->current_table->n_elements;
+	hash_dir *d = sht->current_dir;
+	size_t total = 0;
+	for (size_t i = 0; i < dir_entries(d); i += seg_run(d, i)) {
+		total += d->segs[i]->n_elements;
+	}
+	return total;
 }
 
 
@@ -709,6 +3308,10 @@ uint64_t hash_string(const void *_instr) {
 	return avalanche64(hash, 0);
 }
 
+size_t key_len_string(const void *key) {
+	return strlen(key) + 1;
+}
+
 uint64_t hash_integer(const void *in) {
 	return avalanche64((uint64_t)in, 0);
 }
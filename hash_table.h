@@ -10,27 +10,265 @@ struct shared_hash_table;
 //first klen characters are the key
 //the rest is a null-terminated string
 
+//hashes must never be 0, 1 or 2, the table uses those to mark
+//empty, removed and busy slots. hash_string and hash_integer avoid them
 typedef uint64_t (*hashfn_type)(const void *);
 typedef int (*compfn_type)(const void*, const void*);
 typedef void (*delfn_type)(const void *, void *, void *);
+typedef void (*changefn_type)(uint64_t seq, char removed,
+                              const void *key, void *data, void *params);
+typedef size_t (*keylenfn_type)(const void *);
 
-void insert(struct shared_hash_table *c, const void *key, void *data);
+typedef enum retire_action {
+    retire_block, //wait for the stalled reader, then ask again
+    retire_defer, //queue the insert until memory is freed
+    retire_fail   //reject the insert
+} retire_action;
+typedef retire_action (*retirefn_type)(long reader_id, uint64_t stalled_secs,
+                                       void *params);
+
+//returns 0 if the key was rejected because placing it
+//would have grown the table past its bounds, and insert_deferred
+//if it was queued behind the retired memory limit (set_retired_limit)
+#define insert_deferred 2
+char insert(struct shared_hash_table *c, const void *key, void *data);
 void *remove_element(struct shared_hash_table *c, const void *key);
 
+//cache mode: inserts first evict with CLOCK to stay under max_entries
+//(0 for no limit), and sweep out expired entries a few slots at a time.
+//evictfn gets each evicted value once no reader can see it anymore.
+//expired entries stay visible to readers until they're swept.
+//returns 0 if there wasn't memory for cache mode's per-slot state
+char set_cache_limit(struct shared_hash_table *c,
+                     size_t max_entries,
+                     delfn_type evictfn,
+                     void *params);
+char insert_ttl(struct shared_hash_table *c, const void *key, void *data, uint32_t ttl_secs);
+
+//moves the clock hand over nslots, for a writer with time to spare
+void cache_sweep(struct shared_hash_table *c, size_t nslots);
+
 char apply_to_elem(struct shared_hash_table *sht,
 			       size_t id,
 				   const void *key,
                    void (*appfn)(const void *, void *, void *),
                    void *params);
 
+//stops early once appfnc returns 0
+void shared_table_for_each(struct shared_hash_table *sht,
+                           size_t id,
+                           char (*appfnc)(const void *, const void *, void *),
+                           void *params);
+
+//keeps a small per-thread cache of apply_to_elem hits, looked up by the
+//key pointer, which skips hashing and probing for hot keys. Any removal
+//or resize invalidates every entry for the table
+void set_hot_cache(struct shared_hash_table *sht, char on);
+
+//how segments are sized and probed. Changes apply to each segment
+//as it's next rehashed, sizes are rounded up to powers of two
+struct table_policy {
+    size_t probes;       //slots tried before the stash
+    size_t growth;       //a full segment grows by this factor
+    size_t shrink_ratio; //segments under 1/shrink_ratio full are halved
+    size_t rehash_ratio; //under 1/rehash_ratio, rehashed at the same size
+    size_t target_load;  //percent of slots the auto-tuner aims to fill
+    size_t start_size;   //slots in the first segment
+    size_t seg_elems;    //segments this big split instead of growing
+    char auto_tune;      //adjust probes and growth from what the table sees
+};
+
+void default_policy(struct table_policy *p);
+
 struct shared_hash_table *create_tbl(hashfn_type h, compfn_type c);
+struct shared_hash_table *create_tbl_policy(hashfn_type h,
+                                            compfn_type c,
+                                            const struct table_policy *p);
+void set_table_policy(struct shared_hash_table *sht, const struct table_policy *p);
+void get_table_policy(struct shared_hash_table *sht, struct table_policy *p);
+
+//shared memory mode: one writer process creates the table in a named
+//region of nbytes and uses it like any other table. Reader processes
+//attach to it, and look things up through the handle with ids of their
+//own, since the table only has the writer's hash and compare functions.
+//Only the creating process may write. Keys and data that readers
+//dereference must be allocated in the region with shm_alloc, which
+//takes the table like a write, but may also be called from callbacks
+//run during one.
+//Every process maps the region at the page aligned address at, since
+//it holds pointers. Pick one well away from where the kernel places
+//mappings, such as (void *)0x600000000000 on x86-64 Linux, so it's free
+//in readers too. create_shm_tbl fails if at is taken or 0, or if name is,
+//unless replace is set - which unlinks the old region, orphaning any
+//writer still using it
+struct shm_handle;
+
+struct shared_hash_table *create_shm_tbl(const char *name,
+                                         size_t nbytes,
+                                         void *at,
+                                         hashfn_type h,
+                                         compfn_type c,
+                                         char replace);
+struct shm_handle *attach_shm_tbl(const char *name,
+                                  hashfn_type h,
+                                  compfn_type c);
+char shm_apply_to_elem(struct shm_handle *h,
+                       size_t id,
+                       const void *key,
+                       void (*appfn)(const void *, void *, void *),
+                       void *params);
+void shm_table_for_each(struct shm_handle *h,
+                        size_t id,
+                        char (*appfnc)(const void *, const void *, void *),
+                        void *params);
+void detach_shm_tbl(struct shm_handle *h);
+void *shm_alloc(struct shared_hash_table *sht, size_t nbytes);
+void shm_free(struct shared_hash_table *sht, void *p);
 size_t get_size(struct shared_hash_table *sht);
 
+//tables replaced by a resize are freed once no reader can see them,
+//so a stalled reader makes them pile up. This caps their bytes:
+//a resize that would go over calls retirefn (0 to fail) with the reader
+//holding memory back the longest and for how many seconds, and it picks
+//what to do. retire_block holds the writer and calls retirefn again
+//after a backoff that grows to a millisecond, so the hook needn't wait
+//itself. Deferred inserts are applied in order by later writes that
+//find room or by try_clean_mem, readers don't see them until then.
+//insert returns insert_deferred for them. A resize still goes
+//ahead when nothing is held back, so memory held back by readers stays
+//under max_bytes plus one segment. 0 bytes for no limit
+void set_retired_limit(struct shared_hash_table *sht,
+                       size_t max_bytes,
+                       retirefn_type retirefn,
+                       void *params);
+size_t retired_bytes(struct shared_hash_table *sht);
+
+//the reader id holding back retired memory the longest, or -1
+long stalled_reader(struct shared_hash_table *sht, uint64_t *secs);
+
+//lets the writer split large rehashes across nthreads threads, itself
+//included. The helpers are started here and kept with the table,
+//asleep between rehashes. 0 or 1 stops them. returns 0 if none started
+char set_rehash_threads(struct shared_hash_table *sht, size_t nthreads);
+
+//multi-writer mode: insert and remove_element may be called from any
+//number of threads at once. They claim and tombstone slots with a cas,
+//and only take the table to themselves to grow a segment. Cache mode,
+//the change feed and key copying still go through a single writer
+void set_multi_writer(struct shared_hash_table *sht, char on);
+
+//copies each inserted key into memory owned by the table, keylen gives
+//its size in bytes. Callers may free their keys once insert returns,
+//and callbacks get the table's copy. In shared memory mode the copies
+//live in the region, so readers can compare against them.
+//Not for tables with a change feed, whose records would point at
+//copies freed by a later resize. returns 0 unless the table is still
+//empty and has no change feed
+char set_key_copying(struct shared_hash_table *sht, keylenfn_type keylen);
+
 uint64_t hash_string(const void* elem);
 
+//!keylen for null-terminated strings
+size_t key_len_string(const void *key);
+
 //!hashes the value in the pointer
 uint64_t hash_integer(const void* elem);
 
+//frees retired tables no reader can see anymore, and places
+//deferred inserts there's now room for
 void try_clean_mem(struct shared_hash_table *sht);
 
+//batches of inserts, replacements and removals
+//which readers see either all or none of
+struct hash_batch;
+
+//these return 0, leaving the batch as it was, if out of memory
+struct hash_batch *create_batch();
+char batch_insert(struct hash_batch *b, const void *key, void *data);
+char batch_replace(struct hash_batch *b, const void *key, void *data);
+char batch_remove(struct hash_batch *b, const void *key);
+
+//applies and empties the batch. delfn is called with every value the
+//batch pushed out of the table - removed and replaced values,
+//and inserted values whose key was already present.
+//Readers may still be using them after the commit, so delfn runs once the
+//old table is freed, from a later write or try_clean_mem. It's passed the
+//batch's key, which must stay alive until then - unless the table copies
+//keys, in which case it gets a copy that lives until it returns.
+//returns 0, leaving the batch and the table untouched, if a key couldn't
+//be placed, the table couldn't be resized or retired memory is at its
+//limit, which includes while earlier inserts are still deferred
+char commit_batch(struct shared_hash_table *sht,
+                  struct hash_batch *b,
+                  delfn_type delfn,
+                  void *params);
+void free_batch(struct hash_batch *b);
+
+//change feed: an ordered log of the last capacity writes.
+//A follower takes change_feed_seq, copies the table with
+//shared_table_for_each, then applies read_changes from seq + 1
+//as upserts and removals. Records point at the table's keys, so this
+//returns 0 on a table with key copying on
+char enable_change_feed(struct shared_hash_table *sht, size_t capacity);
+uint64_t change_feed_seq(struct shared_hash_table *sht);
+
+//calls fn on each change from from_seq on and returns the sequence to
+//read from next. returns 0 if changes were overwritten before being
+//read - the follower has to copy the table again
+uint64_t read_changes(struct shared_hash_table *sht,
+                      uint64_t from_seq,
+                      changefn_type fn,
+                      void *params);
+
+//the same for followers in reader processes of a shared memory table,
+//whose change feed is kept in the region
+uint64_t shm_change_feed_seq(struct shm_handle *h);
+uint64_t shm_read_changes(struct shm_handle *h,
+                          uint64_t from_seq,
+                          changefn_type fn,
+                          void *params);
+
+//tracing: insert, remove_element, apply_to_elem and shared_table_for_each
+//record each call to a file, with a stream per calling thread. The file
+//is a trace_header followed by chunks, each a trace_chunk and then
+//nrecs records of that stream. replay_trace plays one back
+#define trace_magic 0x6874726163650001ULL
+#define trace_version 1
+#define trace_when_bits 56
+
+enum trace_op {
+    trace_insert,
+    trace_remove,
+    trace_lookup,
+    trace_for_each
+};
+
+struct trace_header {
+    uint64_t magic;
+    uint64_t version;
+};
+
+struct trace_chunk {
+    uint32_t stream;
+    uint32_t nrecs;
+};
+
+//when has the op in its top bits, and below them
+//nanoseconds since the trace was started
+struct trace_rec {
+    uint64_t keyh;
+    uint64_t when;
+};
+
+//not for shared memory tables. returns 0 if one is already running
+char start_trace(struct shared_hash_table *sht, const char *path);
+char stop_trace(struct shared_hash_table *sht);
+
+//segments replaced by growing or splitting them
+size_t get_resize_count(struct shared_hash_table *sht);
+
+//rehashes split across the set_rehash_threads helpers,
+//0 while there are none
+size_t get_parallel_rehash_count(struct shared_hash_table *sht);
+
 #endif
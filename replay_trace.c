@@ -0,0 +1,213 @@
+//replays a trace from start_trace against a fresh table, a thread
+//per recorded stream, and reports throughput and latencies.
+//
+//  gcc -std=gnu99 -O2 replay_trace.c hash_table.c -lpthread -o replay_trace
+//  ./replay_trace trace.bin [max]
+//
+//with max, every thread runs its stream as fast as it can,
+//otherwise each op waits for the time it was recorded at.
+//keys are the recorded hashes, so the table sees the same spread of keys
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash_table.h"
+
+//hazard ids on a table, streams share them past this many
+#define nreaders 8
+#define nops 4
+
+typedef struct stream {
+	struct trace_rec *recs;
+	size_t n;
+	size_t cap;
+	uint32_t *lat[nops];
+	size_t nlat[nops];
+	uint32_t id;
+	pthread_t thread;
+} stream;
+
+struct shared_hash_table *sht;
+char max_speed;
+uint64_t replay_start;
+
+const char *op_names[nops] = {"insert", "remove", "lookup", "for_each"};
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//the recorded hash is the key, and its own hash
+uint64_t hash_self(const void *k) {
+	return (uint64_t)k;
+}
+
+int comp_keys(const void *k1, const void *k2) {
+	return k1 == k2;
+}
+
+void nop_lookup(const void *k, void *v, void *p) {
+}
+
+char nop_each(const void *k, const void *v, void *p) {
+	return 1;
+}
+
+int cmp_lat(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+int push_rec(stream *s, const struct trace_rec *r) {
+	if (s->n == s->cap) {
+		size_t ncap = s->cap ? 2 * s->cap : 4096;
+		struct trace_rec *nr = realloc(s->recs, ncap * sizeof(*nr));
+		if (!nr) {
+			return 0;
+		}
+		s->recs = nr;
+		s->cap = ncap;
+	}
+	s->recs[s->n++] = *r;
+	return 1;
+}
+
+stream *load_trace(const char *path, size_t *nstreams) {
+	FILE *in = fopen(path, "rb");
+	if (!in) {
+		return 0;
+	}
+	struct trace_header h;
+	if (fread(&h, sizeof(h), 1, in) != 1
+		|| h.magic != trace_magic
+		|| h.version != trace_version) {
+		fclose(in);
+		return 0;
+	}
+	stream *streams = 0;
+	size_t ns = 0;
+	struct trace_chunk c;
+	while (fread(&c, sizeof(c), 1, in) == 1) {
+		if (c.stream >= ns) {
+			stream *more = realloc(streams, (c.stream + 1) * sizeof(stream));
+			if (!more) {
+				break;
+			}
+			memset(more + ns, 0, (c.stream + 1 - ns) * sizeof(stream));
+			streams = more;
+			ns = c.stream + 1;
+		}
+		for (uint32_t i = 0; i < c.nrecs; i++) {
+			struct trace_rec r;
+			if (fread(&r, sizeof(r), 1, in) != 1
+				|| !push_rec(&streams[c.stream], &r)) {
+				break;
+			}
+		}
+	}
+	fclose(in);
+	*nstreams = ns;
+	return streams;
+}
+
+void *run_stream(void *arg) {
+	stream *s = arg;
+	uint64_t mask = ((uint64_t)1 << trace_when_bits) - 1;
+	size_t id = s->id % nreaders;
+	for (int i = 0; i < nops; i++) {
+		s->lat[i] = malloc(s->n * sizeof(uint32_t));
+		s->nlat[i] = 0;
+	}
+	for (size_t i = 0; i < s->n; i++) {
+		struct trace_rec *r = &s->recs[i];
+		unsigned op = r->when >> trace_when_bits;
+		if (op >= nops) {
+			continue;
+		}
+		if (!max_speed) {
+			uint64_t at = replay_start + (r->when & mask);
+			while (now_ns() < at) {}
+		}
+		void *key = (void *)r->keyh;
+		uint64_t t0 = now_ns();
+		switch (op) {
+		case trace_insert:
+			insert(sht, key, key);
+			break;
+		case trace_remove:
+			remove_element(sht, key);
+			break;
+		case trace_lookup:
+			apply_to_elem(sht, id, key, nop_lookup, NULL);
+			break;
+		case trace_for_each:
+			shared_table_for_each(sht, id, nop_each, NULL);
+			break;
+		}
+		uint64_t took = now_ns() - t0;
+		s->lat[op][s->nlat[op]++] = took > UINT32_MAX ? UINT32_MAX : took;
+	}
+	return 0;
+}
+
+void report(stream *streams, size_t ns, double secs) {
+	size_t total = 0;
+	for (int op = 0; op < nops; op++) {
+		size_t n = 0;
+		for (size_t i = 0; i < ns; i++) {
+			n += streams[i].nlat[op];
+		}
+		if (!n) {
+			continue;
+		}
+		uint32_t *all = malloc(n * sizeof(uint32_t));
+		size_t at = 0;
+		for (size_t i = 0; i < ns; i++) {
+			memcpy(all + at, streams[i].lat[op], streams[i].nlat[op] * sizeof(uint32_t));
+			at += streams[i].nlat[op];
+		}
+		qsort(all, n, sizeof(uint32_t), cmp_lat);
+		printf("%-9s %10zu ops  p50 %6u  p90 %6u  p99 %7u  p99.9 %8u  max %9u ns\n",
+			   op_names[op], n,
+			   all[n / 2], all[n * 90 / 100], all[n * 99 / 100],
+			   all[n * 999 / 1000], all[n - 1]);
+		free(all);
+		total += n;
+	}
+	printf("%zu ops in %f seconds, %e ops/second\n", total, secs, total / secs);
+	printf("%zu resizes, %zu slots at the end\n", get_resize_count(sht), get_size(sht));
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		printf("usage: %s trace [max]\n", argv[0]);
+		return 1;
+	}
+	max_speed = argc > 2 && !strcmp(argv[2], "max");
+	size_t ns = 0;
+	stream *streams = load_trace(argv[1], &ns);
+	if (!streams) {
+		printf("couldn't read a trace from %s\n", argv[1]);
+		return 1;
+	}
+	sht = create_tbl(hash_self, comp_keys);
+	printf("replaying %zu streams %s\n", ns, max_speed ? "at full speed" : "as recorded");
+
+	replay_start = now_ns();
+	for (size_t i = 0; i < ns; i++) {
+		streams[i].id = i;
+		pthread_create(&streams[i].thread, NULL, run_stream, &streams[i]);
+	}
+	for (size_t i = 0; i < ns; i++) {
+		pthread_join(streams[i].thread, NULL);
+	}
+	double secs = (now_ns() - replay_start) / 1e9;
+	report(streams, ns, secs);
+	return 0;
+}
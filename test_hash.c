@@ -2,10 +2,13 @@
 #include <stdint.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <sys/time.h>
 
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "hash_table.h"
 
@@ -14,6 +17,14 @@
 #define nwrite 3000
 #define mod_batch 8
 #define nthread 3
+#define nwriters 4
+#define npar_keys (1 << 18)
+#define shm_test_name "/test_hash_shm"
+#define shm_test_base ((void *)0x600000000000)
+#define nshm_keys 20000
+#define shm_feed_name "/test_hash_feed"
+#define shm_feed_base ((void *)0x610000000000)
+#define trace_test_path "/tmp/test_hash.trace"
 
 char keep_modding;
 typedef struct timespec timespec;
@@ -108,6 +119,666 @@ void test_real() {
 	}
 }
 
+void test_batch() {
+	char res;
+	struct hash_batch *b = create_batch();
+	for (size_t i = 0; i < nwrite / 2; i++) {
+		batch_remove(b, (const void *)keys[i].keyval);
+	}
+	commit_batch(sht, b, NULL, NULL);
+	for (size_t i = 0; i < nwrite / 2; i++) {
+		res = 0;
+		apply_to_elem(sht, 0, (const void *)keys[i].keyval, test_exists, &res);
+		if (res) {
+			printf("Batch failed to remove %d\n", (int)i);
+		}
+	}
+	for (size_t i = 0; i < nwrite / 2; i++) {
+		batch_insert(b, (const void *)keys[i].keyval, (void *)keys[i].value);
+	}
+	commit_batch(sht, b, NULL, NULL);
+	free_batch(b);
+	test_real();
+}
+
+void get_value(const void *k, void *v, void *out) {
+	keystr *res = (keystr *)out;
+	res->keyval = 1;
+	res->value = (uint64_t)v;
+}
+
+//each writer inserts its own stripe of keys, then removes every other one
+struct shared_hash_table *mwt;
+
+void *mw_writer(void *val) {
+	size_t w = (size_t)val;
+	for (size_t i = w; i < nwrite * 2; i += nwriters) {
+		insert(mwt, (void *)keys[i].keyval, (void *)keys[i].value);
+	}
+	for (size_t i = w; i < nwrite * 2; i += nwriters) {
+		if ((i & 1) && !remove_element(mwt, (void *)keys[i].keyval)) {
+			printf("Multi-writer failed to remove %d\n", (int)i);
+		}
+	}
+	return 0;
+}
+
+void test_multi_writer() {
+	pthread_t writers[nwriters];
+	mwt = create_tbl(hash_integer, comp_keys);
+	set_multi_writer(mwt, 1);
+	for (size_t i = 0; i < nwriters; i++) {
+		pthread_create(&writers[i], NULL, mw_writer, (void *)i);
+	}
+	for (size_t i = 0; i < nwriters; i++) {
+		pthread_join(writers[i], 0);
+	}
+	for (size_t i = 0; i < nwrite * 2; i++) {
+		keystr res = {0, 0};
+		apply_to_elem(mwt, 0, (const void *)keys[i].keyval, get_value, &res);
+		if ((i & 1) ? res.keyval : (!res.keyval || res.value != keys[i].value)) {
+			printf("Multi-writer failed on %d\n", (int)i);
+		}
+	}
+}
+
+//a cached hit mustn't outlive a removal or a resize of the key's slot
+void test_hot_cache() {
+	struct shared_hash_table *ht = create_tbl(hash_integer, comp_keys);
+	set_hot_cache(ht, 1);
+	const void *k = (const void *)keys[0].keyval;
+	keystr res = {0, 0};
+	insert(ht, k, (void *)1);
+	for (size_t i = 0; i < 2; i++) {
+		res.keyval = 0;
+		apply_to_elem(ht, 0, k, get_value, &res);
+		if (!res.keyval || res.value != 1) {
+			printf("Hot cache missed a present key\n");
+		}
+	}
+	remove_element(ht, k);
+	res.keyval = 0;
+	if (apply_to_elem(ht, 0, k, get_value, &res) || res.keyval) {
+		printf("Hot cache found a removed key\n");
+	}
+	insert(ht, k, (void *)2);
+	apply_to_elem(ht, 0, k, get_value, &res);
+	size_t resizes = get_resize_count(ht);
+	for (size_t i = 1; i < nwrite * 2; i++) {
+		insert(ht, (void *)keys[i].keyval, (void *)keys[i].value);
+	}
+	if (get_resize_count(ht) == resizes) {
+		printf("Hot cache test didn't resize\n");
+	}
+	res.keyval = 0;
+	apply_to_elem(ht, 0, k, get_value, &res);
+	if (!res.keyval || res.value != 2) {
+		printf("Hot cache kept a stale value across a resize\n");
+	}
+}
+
+//a reader parked inside appfn holds back every table retired after it
+//started, until the limit makes retirefn pick what the writer does
+#define retired_max (1 << 12)
+#define parked_reader 1
+
+struct shared_hash_table *rt;
+volatile char parked, unpark;
+retire_action retire_act;
+long retire_calls, retire_id;
+
+void park(const void *k, void *v, void *par) {
+	parked = 1;
+	while (!unpark) {
+		usleep(100);
+	}
+}
+
+void *parked_lookup(void *val) {
+	apply_to_elem(val, parked_reader, (const void *)keys[0].keyval, park, NULL);
+	return 0;
+}
+
+retire_action on_retire(long reader_id, uint64_t stalled_secs, void *params) {
+	retire_calls++;
+	retire_id = reader_id;
+	if (retire_act == retire_block && retire_calls > 3) {
+		unpark = 1;
+	}
+	return retire_act;
+}
+
+void retired_limit_with(retire_action act) {
+	pthread_t reader;
+	size_t counts[3] = {0, 0, 0};
+	rt = create_tbl(hash_integer, comp_keys);
+	insert(rt, (void *)keys[0].keyval, (void *)keys[0].value);
+	set_retired_limit(rt, retired_max, on_retire, NULL);
+	retire_act = act;
+	retire_calls = 0;
+	retire_id = -1;
+	parked = unpark = 0;
+	pthread_create(&reader, NULL, parked_lookup, rt);
+	while (!parked) {
+		usleep(100);
+	}
+	for (size_t i = 1; i < nwrite * 2; i++) {
+		counts[(int)insert(rt, (void *)keys[i].keyval, (void *)keys[i].value)]++;
+	}
+	if (!retire_calls || retire_id != parked_reader) {
+		printf("Retired limit never blamed the parked reader (%d)\n", (int)act);
+	}
+	if (act != retire_block) {
+		uint64_t secs;
+		if (stalled_reader(rt, &secs) != parked_reader) {
+			printf("Parked reader wasn't reported stalled (%d)\n", (int)act);
+		}
+		if (!counts[act == retire_fail ? 0 : insert_deferred] || counts[act == retire_fail ? insert_deferred : 0]) {
+			printf("Inserts at the retired limit weren't %s\n", act == retire_fail ? "failed" : "deferred");
+		}
+	} else if (counts[0] || counts[insert_deferred]) {
+		printf("Inserts at the retired limit didn't wait\n");
+	}
+	//deferred inserts stay out of sight until memory is freed
+	char found = 0;
+	apply_to_elem(rt, 0, (const void *)keys[nwrite * 2 - 1].keyval, test_exists, &found);
+	if (found != (act == retire_block)) {
+		printf("Last insert at the retired limit was%s visible (%d)\n", found ? "" : "n't", (int)act);
+	}
+	unpark = 1;
+	pthread_join(reader, 0);
+	try_clean_mem(rt);
+	uint64_t secs;
+	if (stalled_reader(rt, &secs) != -1 || retired_bytes(rt)) {
+		printf("A released reader still held back retired memory\n");
+	}
+	for (size_t i = 1; i < nwrite * 2; i++) {
+		found = 0;
+		apply_to_elem(rt, 0, (const void *)keys[i].keyval, test_exists, &found);
+		if (act != retire_fail && !found) {
+			printf("Insert at the retired limit was lost %d (%d)\n", (int)i, (int)act);
+		}
+	}
+}
+
+void test_retired_limit() {
+	retired_limit_with(retire_fail);
+	retired_limit_with(retire_defer);
+	retired_limit_with(retire_block);
+}
+
+//evicted values go to evictfn once, and only when no reader can see them
+#define cache_max 64
+
+struct shared_hash_table *ct;
+char evicted[nwrite * 2];
+size_t nevicted;
+
+void on_evict(const void *k, void *v, void *par) {
+	char found = 0;
+	apply_to_elem(ct, 0, k, test_exists, &found);
+	//the parked reader holds keys[0]
+	if (found || (!(uint64_t)v && !unpark)) {
+		printf("Evicted %d while it could still be seen\n", (int)(uint64_t)v);
+	}
+	if (evicted[(uint64_t)v]) {
+		printf("Evicted %d twice\n", (int)(uint64_t)v);
+	}
+	evicted[(uint64_t)v] = 1;
+	nevicted++;
+}
+
+char count_each(const void *k, const void *v, void *count) {
+	(*(size_t *)count)++;
+	return 1;
+}
+
+void test_cache() {
+	pthread_t reader;
+	ct = create_tbl(hash_integer, comp_keys);
+	if (!set_cache_limit(ct, cache_max, on_evict, NULL)) {
+		printf("Couldn't turn on cache mode\n");
+		return;
+	}
+	insert(ct, (void *)keys[0].keyval, (void *)keys[0].value);
+	parked = unpark = 0;
+	pthread_create(&reader, NULL, parked_lookup, ct);
+	while (!parked) {
+		usleep(100);
+	}
+	for (size_t i = 1; i < nwrite * 2; i++) {
+		insert(ct, (void *)keys[i].keyval, (void *)keys[i].value);
+	}
+	size_t live = 0;
+	shared_table_for_each(ct, 0, count_each, &live);
+	if (live > cache_max) {
+		printf("Cache held %d entries over its limit\n", (int)(live - cache_max));
+	}
+	unpark = 1;
+	pthread_join(reader, 0);
+	try_clean_mem(ct);
+	if (!evicted[0]) {
+		printf("Value the reader saw never went to evictfn\n");
+	}
+	if (nevicted + live > nwrite * 2) {
+		printf("Cache evicted more values than it was given\n");
+	}
+
+	//expired entries are swept out, ones without a ttl stay
+	struct shared_hash_table *tt = create_tbl(hash_integer, comp_keys);
+	set_cache_limit(tt, 0, NULL, NULL);
+	for (size_t i = 0; i < nwrite; i++) {
+		if (i & 1) {
+			insert_ttl(tt, (void *)keys[i].keyval, (void *)keys[i].value, 1);
+		}
+		else {
+			insert(tt, (void *)keys[i].keyval, (void *)keys[i].value);
+		}
+	}
+	sleep(2);
+	//past every slot, stashes included
+	cache_sweep(tt, get_size(tt) * 2);
+	for (size_t i = 0; i < nwrite; i++) {
+		char found = 0;
+		apply_to_elem(tt, 0, (const void *)keys[i].keyval, test_exists, &found);
+		if (found == (i & 1)) {
+			printf("Ttl entry %d was%s swept\n", (int)i, found ? "n't" : "");
+		}
+	}
+}
+
+//the table's copies outlive the caller's buffer, and move with rehashes
+int comp_strings(const void *k1, const void *k2) {
+	return !strcmp(k1, k2);
+}
+
+void check_copy(const void *k, void *v, void *buf) {
+	char want[32];
+	sprintf(want, "key %d", (int)(uint64_t)v);
+	if (k == buf || strcmp(k, want)) {
+		printf("Key copy for %d is wrong\n", (int)(uint64_t)v);
+	}
+}
+
+void test_key_copying() {
+	char buf[32];
+	struct shared_hash_table *kt = create_tbl(hash_string, comp_strings);
+	if (!set_key_copying(kt, key_len_string)) {
+		printf("Couldn't copy keys of an empty table\n");
+		return;
+	}
+	for (uint64_t i = 0; i < nwrite * 2; i++) {
+		sprintf(buf, "key %d", (int)i);
+		insert(kt, buf, (void *)i);
+		memset(buf, 'x', sizeof(buf) - 1);
+	}
+	if (!get_resize_count(kt)) {
+		printf("Key copying test didn't resize\n");
+	}
+	for (uint64_t i = 0; i < nwrite * 2; i++) {
+		sprintf(buf, "key %d", (int)i);
+		if (!apply_to_elem(kt, 0, buf, check_copy, buf)) {
+			printf("Copied key %d was lost\n", (int)i);
+		}
+	}
+	//keys already in would be the caller's
+	struct shared_hash_table *ft = create_tbl(hash_string, comp_strings);
+	insert(ft, "key", NULL);
+	if (set_key_copying(ft, key_len_string)) {
+		printf("Key copying was turned on for a non-empty table\n");
+	}
+}
+
+//keys that all hash the same fill their two probes and the stash,
+//then are turned away instead of growing the table without end
+#define ncolliding 32
+#define colliding_fit (2 + 8) //two probes and an 8 slot stash
+
+uint64_t hash_colliding(const void *k) {
+	return 0x5bd1e9955bd1e995;
+}
+
+void test_stash() {
+	struct shared_hash_table *st = create_tbl(hash_colliding, comp_keys);
+	size_t size = get_size(st);
+	uint64_t placed = 0;
+	for (uint64_t i = 1; i <= ncolliding; i++) {
+		if (insert(st, (void *)i, (void *)i)) {
+			if (placed != i - 1) {
+				printf("Colliding key %d placed after one was turned away\n", (int)i);
+			}
+			placed = i;
+		}
+	}
+	if (placed != colliding_fit) {
+		printf("Placed %d colliding keys instead of 2 probes and the stash\n", (int)placed);
+	}
+	if (get_size(st) > size * 8) {
+		printf("Colliding keys grew the table to %d slots\n", (int)get_size(st));
+	}
+	for (uint64_t i = 1; i <= ncolliding; i++) {
+		keystr res = {0, 0};
+		apply_to_elem(st, 0, (void *)i, get_value, &res);
+		if (i <= placed ? (!res.keyval || res.value != i) : res.keyval) {
+			printf("Colliding key %d was%s found\n", (int)i, res.keyval ? "" : "n't");
+		}
+	}
+	//a removal from the stash makes room for one more
+	remove_element(st, (void *)placed);
+	if (!insert(st, (void *)(placed + 1), NULL)) {
+		printf("Stash slot wasn't reused\n");
+	}
+}
+
+//policies are kept in bounds, and the auto-tuner packs a table
+//tighter than the defaults do
+void fill_policy_tbl(struct shared_hash_table *pt, uint64_t n) {
+	for (uint64_t i = 1; i <= n; i++) {
+		insert(pt, (void *)(i * 2862933555777941757), (void *)i);
+	}
+	for (uint64_t i = 1; i <= n; i++) {
+		keystr res = {0, 0};
+		apply_to_elem(pt, 0, (void *)(i * 2862933555777941757), get_value, &res);
+		if (!res.keyval || res.value != i) {
+			printf("Table with a policy lost %d\n", (int)i);
+		}
+	}
+}
+
+void test_policy() {
+	struct table_policy p, got;
+	default_policy(&p);
+	p.probes = 100;
+	p.growth = 3;
+	p.start_size = 1000;
+	p.shrink_ratio = p.rehash_ratio;
+	struct shared_hash_table *pt = create_tbl_policy(hash_integer, comp_keys, &p);
+	get_table_policy(pt, &got);
+	//at most 8 probes, and powers of two
+	if (got.probes != 8 || got.growth != 4 || got.start_size != 1024
+		|| got.shrink_ratio <= got.rehash_ratio) {
+		printf("Policy wasn't kept in bounds\n");
+	}
+	if (get_size(pt) != 1024) {
+		printf("Table didn't start at the policy's size\n");
+	}
+	fill_policy_tbl(pt, nwrite * 2);
+	default_policy(&p);
+	p.probes = 4;
+	set_table_policy(pt, &p);
+	get_table_policy(pt, &got);
+	if (got.probes != 4 || got.growth != 2) {
+		printf("Policy wasn't replaced\n");
+	}
+	fill_policy_tbl(pt, npar_keys);
+
+	struct shared_hash_table *dt = create_tbl(hash_integer, comp_keys);
+	fill_policy_tbl(dt, npar_keys);
+	default_policy(&p);
+	p.auto_tune = 1;
+	struct shared_hash_table *at = create_tbl_policy(hash_integer, comp_keys, &p);
+	fill_policy_tbl(at, npar_keys);
+	get_table_policy(at, &got);
+	if (got.probes == p.probes && got.growth == p.growth) {
+		printf("Auto-tuner left the policy alone\n");
+	}
+	if (get_size(at) >= get_size(dt)) {
+		printf("Auto-tuned table took %d slots, the default %d\n",
+			   (int)get_size(at), (int)get_size(dt));
+	}
+}
+
+//a trace read back the way replay_trace loads it has a stream
+//per thread, each with that thread's calls in order
+#define ntrace_writer (nwrite * 2 + nwrite / 2 + 1)
+
+struct shared_hash_table *trt;
+struct trace_rec trace_recs[2][ntrace_writer];
+size_t ntrace_recs[2];
+
+void *trace_reader(void *val) {
+	for (size_t i = 0; i < nwrite; i++) {
+		apply_to_elem(trt, val ? 1 : 0, (const void *)keys[i].keyval, dummyfn, &keys[i]);
+	}
+	return 0;
+}
+
+char check_trace_rec(struct trace_rec *r, enum trace_op op, uint64_t keyh, uint64_t *last) {
+	uint64_t mask = ((uint64_t)1 << trace_when_bits) - 1;
+	char ok = r->when >> trace_when_bits == op && r->keyh == keyh && (r->when & mask) >= *last;
+	*last = r->when & mask;
+	return ok;
+}
+
+void test_trace() {
+	pthread_t reader;
+	trt = create_tbl(hash_integer, comp_keys);
+	if (!start_trace(trt, trace_test_path)) {
+		printf("Couldn't start a trace\n");
+		return;
+	}
+	if (start_trace(trt, trace_test_path)) {
+		printf("Started a trace twice\n");
+	}
+	for (size_t i = 0; i < nwrite; i++) {
+		insert(trt, (void *)keys[i].keyval, (void *)keys[i].value);
+	}
+	pthread_create(&reader, NULL, trace_reader, (void *)1);
+	trace_reader(NULL);
+	pthread_join(reader, 0);
+	for (size_t i = 0; i < nwrite / 2; i++) {
+		remove_element(trt, (void *)keys[i].keyval);
+	}
+	shared_table_for_each(trt, 0, count_each, &(size_t){0});
+	stop_trace(trt);
+	//calls after the trace stopped aren't in it
+	insert(trt, (void *)keys[0].keyval, (void *)keys[0].value);
+
+	FILE *in = fopen(trace_test_path, "rb");
+	struct trace_header h;
+	struct trace_chunk c;
+	if (!in || fread(&h, sizeof(h), 1, in) != 1
+		|| h.magic != trace_magic || h.version != trace_version) {
+		printf("Trace header is wrong\n");
+		if (in) {
+			fclose(in);
+		}
+		return;
+	}
+	ntrace_recs[0] = ntrace_recs[1] = 0;
+	while (fread(&c, sizeof(c), 1, in) == 1) {
+		if (c.stream > 1 || ntrace_recs[c.stream] + c.nrecs > ntrace_writer
+			|| fread(&trace_recs[c.stream][ntrace_recs[c.stream]], sizeof(struct trace_rec),
+					 c.nrecs, in) != c.nrecs) {
+			printf("Trace chunk is wrong\n");
+			break;
+		}
+		ntrace_recs[c.stream] += c.nrecs;
+	}
+	fclose(in);
+	unlink(trace_test_path);
+	//the writer's stream is the one that starts with an insert
+	size_t w = ntrace_recs[1] && trace_recs[1][0].when >> trace_when_bits == trace_insert;
+	struct trace_rec *wr = trace_recs[w], *rr = trace_recs[!w];
+	if (ntrace_recs[w] != ntrace_writer || ntrace_recs[!w] != nwrite) {
+		printf("Trace has %d and %d records\n", (int)ntrace_recs[w], (int)ntrace_recs[!w]);
+		return;
+	}
+	uint64_t wlast = 0, rlast = 0;
+	for (size_t i = 0; i < nwrite; i++) {
+		uint64_t keyh = hash_integer((void *)keys[i].keyval);
+		if (!check_trace_rec(&wr[i], trace_insert, keyh, &wlast)
+			|| !check_trace_rec(&rr[i], trace_lookup, keyh, &rlast)) {
+			printf("Trace record %d is wrong\n", (int)i);
+		}
+	}
+	for (size_t i = 0; i < nwrite; i++) {
+		uint64_t keyh = hash_integer((void *)keys[i].keyval);
+		if (!check_trace_rec(&wr[nwrite + i], trace_lookup, keyh, &wlast)) {
+			printf("Trace record %d is wrong\n", (int)(nwrite + i));
+		}
+	}
+	for (size_t i = 0; i < nwrite / 2; i++) {
+		uint64_t keyh = hash_integer((void *)keys[i].keyval);
+		if (!check_trace_rec(&wr[nwrite * 2 + i], trace_remove, keyh, &wlast)) {
+			printf("Trace record %d is wrong\n", (int)(nwrite * 2 + i));
+		}
+	}
+	if (!check_trace_rec(&wr[ntrace_writer - 1], trace_for_each, 0, &wlast)) {
+		printf("Trace missed the for_each\n");
+	}
+}
+
+//replays the feed as upserts and removals
+void apply_change(uint64_t seq, char removed, const void *key, void *data, void *replica) {
+	remove_element(replica, key);
+	if (!removed) {
+		insert(replica, key, data);
+	}
+}
+
+void test_feed() {
+	struct shared_hash_table *src = create_tbl(hash_integer, comp_keys);
+	struct shared_hash_table *replica = create_tbl(hash_integer, comp_keys);
+	enable_change_feed(src, nwrite * 4);
+	uint64_t from = change_feed_seq(src) + 1;
+	for (size_t i = 0; i < nwrite * 2; i++) {
+		insert(src, (void *)keys[i].keyval, (void *)keys[i].value);
+	}
+	for (size_t i = 0; i < nwrite * 2; i += 3) {
+		remove_element(src, (void *)keys[i].keyval);
+	}
+	from = read_changes(src, from, apply_change, replica);
+	if (!from) {
+		printf("Change feed was lapped\n");
+	}
+	for (size_t i = 0; i < nwrite * 2; i++) {
+		keystr want = {0, 0}, got = {0, 0};
+		apply_to_elem(src, 0, (const void *)keys[i].keyval, get_value, &want);
+		apply_to_elem(replica, 0, (const void *)keys[i].keyval, get_value, &got);
+		if (want.keyval != got.keyval || want.value != got.value) {
+			printf("Replica differs on %d\n", (int)i);
+		}
+	}
+	//a follower that falls a whole feed behind has to copy the table again
+	for (size_t n = 0; n < 2; n++) {
+		for (size_t i = 0; i < nwrite * 2; i++) {
+			remove_element(src, (void *)keys[i].keyval);
+			insert(src, (void *)keys[i].keyval, (void *)keys[i].value);
+		}
+	}
+	if (read_changes(src, from, apply_change, replica)) {
+		printf("Change feed lapping went unnoticed\n");
+	}
+}
+
+//enough keys that segments get big enough to be rehashed by the helpers
+void test_parallel_rehash() {
+	struct shared_hash_table *pt = create_tbl(hash_integer, comp_keys);
+	if (!set_rehash_threads(pt, 4)) {
+		printf("Couldn't start rehash threads\n");
+		return;
+	}
+	for (uint64_t i = 1; i <= npar_keys; i++) {
+		insert(pt, (void *)(i * 2862933555777941757), (void *)i);
+	}
+	if (!get_parallel_rehash_count(pt)) {
+		printf("No rehash went to the helpers\n");
+	}
+	for (uint64_t i = 1; i <= npar_keys; i++) {
+		keystr res = {0, 0};
+		apply_to_elem(pt, 0, (void *)(i * 2862933555777941757), get_value, &res);
+		if (!res.keyval || res.value != i) {
+			printf("Parallel rehash lost %d\n", (int)i);
+		}
+	}
+}
+
+//a region a few times the table's peak has room for it,
+//however the segments it frees were sized
+void test_shm_region() {
+	struct shared_hash_table *st = create_shm_tbl(shm_test_name, 64 << 20, shm_test_base,
+												  hash_integer, comp_keys, 1);
+	if (!st) {
+		printf("Couldn't create shared table\n");
+		return;
+	}
+	for (uint64_t i = 1; i <= nshm_keys; i++) {
+		if (!insert(st, (void *)(i * 2862933555777941757), (void *)i)) {
+			printf("Shared table rejected %d\n", (int)i);
+		}
+	}
+	shm_unlink(shm_test_name);
+}
+
+//a follower in another process replays the feed of a shared table.
+//it's forked first, so the region's address is free in it
+int shm_follower(int ready) {
+	char c;
+	if (read(ready, &c, 1) != 1) {
+		return 1;
+	}
+	struct shm_handle *h = attach_shm_tbl(shm_feed_name, hash_integer, comp_keys);
+	if (!h) {
+		printf("Follower couldn't attach\n");
+		return 1;
+	}
+	struct shared_hash_table *replica = create_tbl(hash_integer, comp_keys);
+	int failed = 0;
+	if (!shm_read_changes(h, 1, apply_change, replica)) {
+		printf("Follower was lapped\n");
+		failed = 1;
+	}
+	for (size_t i = 0; i < nwrite * 2; i++) {
+		keystr want = {0, 0}, got = {0, 0};
+		shm_apply_to_elem(h, 1, (const void *)keys[i].keyval, get_value, &want);
+		apply_to_elem(replica, 0, (const void *)keys[i].keyval, get_value, &got);
+		if (want.keyval != got.keyval || want.value != got.value) {
+			printf("Follower differs on %d\n", (int)i);
+			failed = 1;
+		}
+	}
+	detach_shm_tbl(h);
+	return failed;
+}
+
+void test_shm_feed() {
+	int ready[2];
+	if (pipe(ready)) {
+		printf("Couldn't make a pipe\n");
+		return;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(ready[1]);
+		_exit(shm_follower(ready[0]));
+	}
+	close(ready[0]);
+	struct shared_hash_table *st = create_shm_tbl(shm_feed_name, 64 << 20, shm_feed_base,
+												  hash_integer, comp_keys, 1);
+	if (!st || !enable_change_feed(st, nwrite * 4)) {
+		printf("Couldn't create shared table with a feed\n");
+	}
+	else {
+		for (size_t i = 0; i < nwrite * 2; i++) {
+			insert(st, (void *)keys[i].keyval, (void *)keys[i].value);
+		}
+		for (size_t i = 0; i < nwrite * 2; i += 3) {
+			remove_element(st, (void *)keys[i].keyval);
+		}
+		if (write(ready[1], "", 1) != 1) {
+			printf("Couldn't start the follower\n");
+		}
+	}
+	close(ready[1]);
+	int status;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+		printf("Shared table follower failed\n");
+	}
+	shm_unlink(shm_feed_name);
+}
+
 void *modify(void *val) {
 	uint64_t rng = (uint64_t)val;
 	while(__atomic_load_n(&keep_modding, __ATOMIC_RELAXED)) {
@@ -143,6 +814,19 @@ int main() {
 	init_keys();
 	do_inserts();
 	test_real();
+	test_batch();
+	test_multi_writer();
+	test_hot_cache();
+	test_retired_limit();
+	test_cache();
+	test_key_copying();
+	test_stash();
+	test_policy();
+	test_trace();
+	test_feed();
+	test_parallel_rehash();
+	test_shm_region();
+	test_shm_feed();
 	//return 0;
 	long ts = myclock();
 	keep_modding = 1;